@@ -0,0 +1,377 @@
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "Simulation.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+// Headless benchmark of the solver, runs the same seeded scene once per
+// combination of the selected options (all layouts and P2G modes by default).
+// usage: mls-mpm-bench [steps] [layout=linear|tiled] [p2g=scatter|tiles]
+//                      [accum=float|fixed] [fluid=gather|j] [fused=off|on]
+//                      [graph=off|on] [transfer=apic|pic|flip]
+//                      [kernel=linear|quadratic|cubic]
+//                      [pressure=explicit|implicit] [dt=seconds] [stiffness=S]
+//                      [resample=off|on] [sleep=off|on] [warmup=steps]
+//                      [domain=X[xYxZ]] [window=off|on]
+//                      [levels=1|2] [budget=blocks]
+//                      [threads=N] [pin=off|on] [snapshot=/name]
+//                      [pages=small|thp|huge]
+//                      [simd=auto|generic|sse4.2|avx2|avx512]
+//                      [affine=fp32|fp16|bf16] [packvel=off|on] [grid16=off|on]
+// The hash covers the bits of every particle position and velocity, equal
+// hashes mean bit identical runs. allocs/step counts the allocations of
+// the timed steps, which should all be 0: from the heap, pages mapped by
+// PageAllocator (grid and particle arrays, arena blocks) and blocks added
+// by the arenas.
+// With reduced precision storage (affine=, packvel=, grid16=) every
+// combination also runs at full precision, and the reduced run reports its
+// speedup over it and how far its particles drifted away.
+// ms/sim s is the wall time per second of simulated time, which compares
+// runs at different dt; cg is the mean CG iterations of a step. Resampling
+// changes the particle count, reported at the end of the run along with the
+// most particles a cell holds. Blocks only fall asleep once the fluid has
+// settled, which takes a few thousand warmup steps in this scene.
+// domain= sizes the box in cells, the grid being a window of it that
+// window=on moves along with the fluid; mean pos is in domain coordinates.
+// levels=2 runs the calm fluid through a coarse grid, fine counts the blocks
+// left at the grid's resolution, at most budget= of them.
+// snapshot= publishes every step into that shared memory channel, which
+// mls-mpm-snapshots reads from another process.
+
+const unsigned int seed = 42;
+int warmup_steps = 10;
+
+struct Config {
+    GridLayout layout;
+    P2GMode p2g;
+    bool fixed;
+    FluidModel fluid;
+    bool fused;
+    bool graph;
+    TransferScheme transfer;
+    KernelOrder kernel;
+    PressureSolver pressure;
+    float dt;
+    bool resample;
+    bool sleep;
+    bool window;
+    int levels;
+    Precision affine;
+    bool packed_velocity;
+    bool half_grid;
+};
+
+struct Result {
+    double ms_per_step;
+    double pressure_iterations;
+    double allocations_per_step;
+    double page_allocations_per_step;
+    double arena_blocks_per_step;
+    size_t arena_bytes;
+    glm::vec3 mean_pos;
+    float kinetic_energy;
+    int max_per_cell;
+    size_t sleeping;
+    int fine_blocks;
+    glm::ivec3 grid_size;
+    uint64_t hash;
+    std::vector<glm::vec3> positions;
+};
+
+const char* layout_names[] = {"linear", "tiled"};
+const char* p2g_names[] = {"scatter", "tiles"};
+const char* accum_names[] = {"float", "fixed"};
+const char* fluid_names[] = {"gather", "j"};
+const char* switch_names[] = {"off", "on"};
+const char* page_names[] = {"small", "thp", "huge"};
+const char* simd_names[] = {"auto", "generic", "sse4.2", "avx2", "avx512"};
+const char* transfer_names[] = {"apic", "pic", "flip"};
+const char* kernel_names[] = {"linear", "quadratic", "cubic"};
+const char* precision_names[] = {"fp32", "fp16", "bf16"};
+const char* pressure_names[] = {"explicit", "implicit"};
+const float default_dt = dt;
+
+// Every operator new of the program, array and nothrow forms included,
+// which forward to these two
+std::atomic<uint64_t> allocations {0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* data = std::malloc(size ? size : 1))
+        return data;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    // aligned_alloc takes a nonzero multiple of the alignment
+    size_t alignment = (size_t)align;
+    size_t bytes = std::max((size + alignment - 1) / alignment, (size_t)1) * alignment;
+    if (void* data = std::aligned_alloc(alignment, bytes))
+        return data;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* data) noexcept { std::free(data); }
+void operator delete(void* data, size_t) noexcept { std::free(data); }
+void operator delete(void* data, std::align_val_t) noexcept { std::free(data); }
+void operator delete(void* data, size_t, std::align_val_t) noexcept { std::free(data); }
+
+// FNV-1a over raw bytes
+uint64_t Hash(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+Result Run(const Config& config, int steps) {
+    grid_layout = config.layout;
+    p2g_mode = config.p2g;
+    deterministic_p2g = config.fixed;
+    fluid_model = config.fluid;
+    fused_transfers = config.fused;
+    task_graph = config.graph;
+    transfer_scheme = config.transfer;
+    kernel_order = config.kernel;
+    pressure_solver = config.pressure;
+    dt = config.dt;
+    resample_particles = config.resample;
+    sleeping_blocks = config.sleep;
+    moving_window = config.window;
+    grid_levels = config.levels;
+    affine_precision = config.affine;
+    packed_velocity = config.packed_velocity;
+    half_grid_velocity = config.half_grid;
+    Init(seed);
+    for (int i = 0; i < warmup_steps; ++i)
+        Simulate();
+
+    uint64_t allocations_before = allocations.load();
+    uint64_t page_allocations_before = page_allocations.load();
+    uint64_t arena_blocks_before = arena_blocks.load();
+    int pressure_iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; ++i) {
+        Simulate();
+        pressure_iterations += PressureIterations();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    Result result;
+    result.ms_per_step = std::chrono::duration<double, std::milli>(end - start).count() / steps;
+    result.pressure_iterations = (double)pressure_iterations / steps;
+    result.allocations_per_step = (double)(allocations.load() - allocations_before) / steps;
+    result.page_allocations_per_step = (double)(page_allocations.load() - page_allocations_before) / steps;
+    result.arena_blocks_per_step = (double)(arena_blocks.load() - arena_blocks_before) / steps;
+    result.arena_bytes = StepArena().Used();
+    result.sleeping = SleepingParticles();
+    result.fine_blocks = FineBlocks();
+    SyncParticles();
+    result.mean_pos = glm::vec3(0.0f);
+    result.kinetic_energy = 0.0f;
+    result.hash = 14695981039346656037ull;
+    result.positions.reserve(particles.size());
+    for (const auto& p: particles) {
+        result.hash = Hash(result.hash, &p.pos, sizeof(p.pos));
+        result.hash = Hash(result.hash, &p.vel, sizeof(p.vel));
+        result.mean_pos += p.pos;
+        result.kinetic_energy += 0.5f * p.mass * glm::dot(p.vel, p.vel);
+        result.positions.push_back(p.pos);
+    }
+    result.mean_pos /= (float)particles.size();
+    result.mean_pos += glm::vec3(GridOrigin());
+    glm::ivec3 size = GridSize();
+    result.grid_size = size;
+    std::vector<int> per_cell(size.x * size.y * size.z, 0);
+    result.max_per_cell = 0;
+    for (const auto& p: particles) {
+        glm::ivec3 c = glm::ivec3(p.pos);
+        int n = ++per_cell[c.x + (c.y + c.z * size.y) * size.x];
+        result.max_per_cell = std::max(result.max_per_cell, n);
+    }
+    return result;
+}
+
+void Report(const Config& config, const Result& result) {
+    std::string name = std::string(layout_names[config.layout]) + "/" + p2g_names[config.p2g] +
+                       "/" + accum_names[config.fixed] + "/" + fluid_names[config.fluid] +
+                       (config.fused ? "/fused" : "") + (config.graph ? "/graph" : "") +
+                       (config.transfer != TRANSFER_APIC ? std::string("/") + transfer_names[config.transfer] : "") +
+                       (config.kernel != KERNEL_QUADRATIC ? std::string("/") + kernel_names[config.kernel] : "") +
+                       (config.pressure != PRESSURE_EXPLICIT ? std::string("/") + pressure_names[config.pressure] : "") +
+                       (config.dt != default_dt ? "/dt=" + std::to_string(config.dt).substr(0, 4) : "") +
+                       (config.resample ? "/resample" : "") + (config.sleep ? "/sleep" : "") +
+                       (config.window ? "/window" : "") + (config.levels > 1 ? "/levels" : "") +
+                       (config.affine != PRECISION_FP32 ? std::string("/C:") + precision_names[config.affine] : "") +
+                       (config.affine != PRECISION_FP32 && config.packed_velocity ? "+vel" : "") +
+                       (config.half_grid ? "/grid16" : "");
+    printf("%-35s %8.3f ms/step %8.1f ms/sim s %8.2f Mparticles/s   %zu particles   max/cell %d   "
+           "%zu asleep   %d fine   grid %dx%dx%d   cg %.1f   allocs/step %.2f heap %.2f pages %.2f arena   "
+           "arena %zu KB   mean pos (%.4f, %.4f, %.4f)   kinetic %.4f   hash %016llx\n",
+           name.c_str(), result.ms_per_step, result.ms_per_step / config.dt,
+           particles.size() / result.ms_per_step / 1000.0, particles.size(), result.max_per_cell,
+           result.sleeping, result.fine_blocks, result.grid_size.x, result.grid_size.y, result.grid_size.z,
+           result.pressure_iterations,
+           result.allocations_per_step, result.page_allocations_per_step, result.arena_blocks_per_step,
+           result.arena_bytes >> 10,
+           result.mean_pos.x, result.mean_pos.y, result.mean_pos.z,
+           result.kinetic_energy, (unsigned long long)result.hash);
+}
+
+// Speedup and drift of a reduced precision run over the full precision one
+void ReportDrift(const Result& result, const Result& reference) {
+    // Resampled runs may differ in count, their extra particles are left out
+    size_t count = std::min(result.positions.size(), reference.positions.size());
+    double squared = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 d = result.positions[i] - reference.positions[i];
+        squared += glm::dot(d, d);
+    }
+    printf("%-35s %8.3fx speed   rms drift %.3e cells   kinetic %+.3f%%\n", "  vs fp32",
+           reference.ms_per_step / result.ms_per_step,
+           std::sqrt(squared / count),
+           100.0 * (result.kinetic_energy - reference.kinetic_energy) / reference.kinetic_energy);
+}
+
+// Index of `value` in `names`, exits on unknown values
+int Lookup(const char* value, const char* const* names, int count) {
+    for (int i = 0; i < count; ++i)
+        if (!strcmp(value, names[i]))
+            return i;
+    fprintf(stderr, "unknown value: %s\n", value);
+    std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    int steps = 100;
+    Precision affine = PRECISION_FP32;
+    bool packed = false, half_grid = false;
+    std::vector<int> layouts, p2gs, accums, fluids, fuseds, graphs, transfers, kernels, pressures, resamples, sleeps,
+                     windows, levels;
+    std::vector<float> dts;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (!strncmp(arg, "layout=", 7))
+            layouts.push_back(Lookup(arg + 7, layout_names, 2));
+        else if (!strncmp(arg, "p2g=", 4))
+            p2gs.push_back(Lookup(arg + 4, p2g_names, 2));
+        else if (!strncmp(arg, "accum=", 6))
+            accums.push_back(Lookup(arg + 6, accum_names, 2));
+        else if (!strncmp(arg, "fluid=", 6))
+            fluids.push_back(Lookup(arg + 6, fluid_names, 2));
+        else if (!strncmp(arg, "fused=", 6))
+            fuseds.push_back(Lookup(arg + 6, switch_names, 2));
+        else if (!strncmp(arg, "graph=", 6))
+            graphs.push_back(Lookup(arg + 6, switch_names, 2));
+        else if (!strncmp(arg, "transfer=", 9))
+            transfers.push_back(Lookup(arg + 9, transfer_names, 3));
+        else if (!strncmp(arg, "kernel=", 7))
+            kernels.push_back(Lookup(arg + 7, kernel_names, 3));
+        else if (!strncmp(arg, "pressure=", 9))
+            pressures.push_back(Lookup(arg + 9, pressure_names, 2));
+        else if (!strncmp(arg, "dt=", 3))
+            dts.push_back(std::atof(arg + 3));
+        else if (!strncmp(arg, "resample=", 9))
+            resamples.push_back(Lookup(arg + 9, switch_names, 2));
+        else if (!strncmp(arg, "sleep=", 6))
+            sleeps.push_back(Lookup(arg + 6, switch_names, 2));
+        else if (!strncmp(arg, "window=", 7))
+            windows.push_back(Lookup(arg + 7, switch_names, 2));
+        else if (!strncmp(arg, "levels=", 7))
+            levels.push_back(std::atoi(arg + 7));
+        else if (!strncmp(arg, "budget=", 7))
+            fine_block_budget = std::atoi(arg + 7);
+        else if (!strncmp(arg, "domain=", 7))
+            sscanf(arg + 7, "%dx%dx%d", &domain_size.x, &domain_size.y, &domain_size.z);
+        else if (!strncmp(arg, "warmup=", 7))
+            warmup_steps = std::atoi(arg + 7);
+        else if (!strncmp(arg, "stiffness=", 10))
+            eos_stiffness = std::atof(arg + 10);
+        else if (!strncmp(arg, "threads=", 8))
+            solver_threads = std::atoi(arg + 8);
+        else if (!strncmp(arg, "snapshot=", 9))
+            snapshot_channel = arg + 9;
+        else if (!strncmp(arg, "pin=", 4))
+            pin_threads = Lookup(arg + 4, switch_names, 2);
+        else if (!strncmp(arg, "pages=", 6))
+            huge_pages = (HugePages)Lookup(arg + 6, page_names, 3);
+        else if (!strncmp(arg, "affine=", 7))
+            affine = (Precision)Lookup(arg + 7, precision_names, 3);
+        else if (!strncmp(arg, "packvel=", 8))
+            packed = Lookup(arg + 8, switch_names, 2);
+        else if (!strncmp(arg, "grid16=", 7))
+            half_grid = Lookup(arg + 7, switch_names, 2);
+        else if (!strncmp(arg, "simd=", 5))
+            simd_level = (SimdLevel)Lookup(arg + 5, simd_names, 5);
+        else
+            steps = std::atoi(arg);
+    }
+    if (layouts.empty()) layouts = {GRID_LINEAR, GRID_TILED};
+    if (p2gs.empty()) p2gs = {P2G_SCATTER, P2G_TILES};
+    if (accums.empty()) accums = {0};
+    if (fluids.empty()) fluids = {FLUID_GATHER};
+    if (fuseds.empty()) fuseds = {0};
+    if (graphs.empty()) graphs = {0};
+    if (transfers.empty()) transfers = {TRANSFER_APIC};
+    if (kernels.empty()) kernels = {KERNEL_QUADRATIC};
+    if (pressures.empty()) pressures = {PRESSURE_EXPLICIT};
+    if (dts.empty()) dts = {default_dt};
+    if (resamples.empty()) resamples = {0};
+    if (sleeps.empty()) sleeps = {0};
+    if (windows.empty()) windows = {0};
+    if (levels.empty()) levels = {1};
+
+    Init(seed); // Picks the kernels
+    printf("%d threads, %d steps, %s pages, %s kernels, eos stiffness %g, domain %dx%dx%d\n",
+           SolverPool().Size(), steps, page_names[huge_pages], SimdLevelName(SimdLevelInUse()), eos_stiffness,
+           domain_size.x, domain_size.y, domain_size.z);
+    std::vector<Config> configs;
+    for (int layout: layouts)
+        for (int p2g: p2gs)
+            for (int accum: accums)
+                for (int fluid: fluids)
+                    for (int fused: fuseds)
+                        for (int graph: graphs)
+                            for (int transfer: transfers)
+                                for (int kernel: kernels)
+                                    for (int pressure: pressures)
+                                        for (float step: dts)
+                                            for (int resample: resamples)
+                                                for (int sleep: sleeps)
+                                                    for (int window: windows)
+                                                        for (int level: levels)
+                                                            configs.push_back({(GridLayout)layout, (P2GMode)p2g, accum == 1,
+                                                                               (FluidModel)fluid, fused == 1, graph == 1,
+                                                                               (TransferScheme)transfer, (KernelOrder)kernel,
+                                                                               (PressureSolver)pressure, step, resample == 1,
+                                                                               sleep == 1, window == 1, level,
+                                                                               PRECISION_FP32, false, false});
+
+    for (Config config: configs) {
+        Result reference = Run(config, steps);
+        Report(config, reference);
+        if (affine == PRECISION_FP32 && !half_grid)
+            continue;
+        config.affine = affine;
+        config.packed_velocity = packed;
+        config.half_grid = half_grid;
+        Result result = Run(config, steps);
+        Report(config, result);
+        ReportDrift(result, reference);
+    }
+    return 0;
+}
@@ -0,0 +1,173 @@
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "Distributed.hpp"
+
+#include <glm/glm.hpp>
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Headless run of the solver over MPI ranks, see Distributed.hpp. Start it
+// under the MPI launcher, e.g. mpirun -np 4 mls-mpm-distributed 30.
+// usage: mls-mpm-distributed [steps] [layout=linear|tiled] [p2g=scatter|tiles]
+//                            [accum=float|fixed] [fluid=gather|j]
+//                            [transfer=apic|pic|flip]
+//                            [kernel=linear|quadratic|cubic] [resample=off|on]
+//                            [domain=X[xYxZ]] [threads=N] [check=off|on]
+// threads= is per rank, 1 by default. Rank 0 prints the totals over the
+// ranks: particle count, mass, mean position in domain coordinates and
+// kinetic energy. check=on first runs the same steps in rank 0 alone and
+// compares: the count and mass must match, the mean position and kinetic
+// energy be within 1e-4. One rank matches exactly; with more, the halo
+// sums round differently and the runs drift apart over the steps like
+// threaded runs of P2G_TILES do, so check over a few dozen steps. With
+// resample=on only the mass is compared, the merges follow the order of
+// the particles, which migrating changes. A failed check exits with an
+// error.
+
+const unsigned int seed = 42;
+
+const char* layout_names[] = {"linear", "tiled"};
+const char* p2g_names[] = {"scatter", "tiles"};
+const char* accum_names[] = {"float", "fixed"};
+const char* fluid_names[] = {"gather", "j"};
+const char* switch_names[] = {"off", "on"};
+const char* transfer_names[] = {"apic", "pic", "flip"};
+const char* kernel_names[] = {"linear", "quadratic", "cubic"};
+
+// Sums over the particles of a rank
+struct Totals {
+    double count;
+    double mass;
+    double pos[3];
+    double kinetic_energy;
+};
+
+Totals Measure() {
+    SyncParticles();
+    glm::vec3 origin = glm::vec3(GridOrigin());
+    Totals totals = {};
+    for (const auto& p: particles) {
+        glm::vec3 pos = p.pos + origin;
+        totals.count += 1.0;
+        totals.mass += p.mass;
+        for (int a = 0; a < 3; ++a)
+            totals.pos[a] += pos[a];
+        totals.kinetic_energy += 0.5 * p.mass * glm::dot(p.vel, p.vel);
+    }
+    return totals;
+}
+
+void Report(const char* name, const Totals& totals, double ms_per_step) {
+    printf("%-12s %8.3f ms/step   %.0f particles   mass %.1f   mean pos (%.4f, %.4f, %.4f)   kinetic %.4f\n",
+           name, ms_per_step, totals.count, totals.mass,
+           totals.pos[0] / totals.count, totals.pos[1] / totals.count, totals.pos[2] / totals.count,
+           totals.kinetic_energy);
+}
+
+// Index of `value` in `names`, exits on unknown values
+int Lookup(const char* value, const char* const* names, int count) {
+    for (int i = 0; i < count; ++i)
+        if (!strcmp(value, names[i]))
+            return i;
+    fprintf(stderr, "unknown value: %s\n", value);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int rank, ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+    int steps = 30;
+    bool check = false;
+    solver_threads = 1;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (!strncmp(arg, "layout=", 7))
+            grid_layout = (GridLayout)Lookup(arg + 7, layout_names, 2);
+        else if (!strncmp(arg, "p2g=", 4))
+            p2g_mode = (P2GMode)Lookup(arg + 4, p2g_names, 2);
+        else if (!strncmp(arg, "accum=", 6))
+            deterministic_p2g = Lookup(arg + 6, accum_names, 2);
+        else if (!strncmp(arg, "fluid=", 6))
+            fluid_model = (FluidModel)Lookup(arg + 6, fluid_names, 2);
+        else if (!strncmp(arg, "transfer=", 9))
+            transfer_scheme = (TransferScheme)Lookup(arg + 9, transfer_names, 3);
+        else if (!strncmp(arg, "kernel=", 7))
+            kernel_order = (KernelOrder)Lookup(arg + 7, kernel_names, 3);
+        else if (!strncmp(arg, "resample=", 9))
+            resample_particles = Lookup(arg + 9, switch_names, 2);
+        else if (!strncmp(arg, "domain=", 7))
+            sscanf(arg + 7, "%dx%dx%d", &domain_size.x, &domain_size.y, &domain_size.z);
+        else if (!strncmp(arg, "threads=", 8))
+            solver_threads = std::atoi(arg + 8);
+        else if (!strncmp(arg, "check=", 6))
+            check = Lookup(arg + 6, switch_names, 2);
+        else
+            steps = std::atoi(arg);
+    }
+    // Without a window, the single process grid covers grid_res^3 only
+    if (check && glm::any(glm::greaterThan(domain_size, glm::ivec3(grid_res))))
+        moving_window = true;
+
+    Totals reference = {};
+    double reference_ms = 0.0;
+    if (check && rank == 0) {
+        Init(seed);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; ++i)
+            Simulate();
+        auto end = std::chrono::steady_clock::now();
+        reference_ms = std::chrono::duration<double, std::milli>(end - start).count() / steps;
+        reference = Measure();
+    }
+
+    InitDistributed(seed);
+    MPI_Barrier(MPI_COMM_WORLD);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; ++i)
+        SimulateDistributed();
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count() / steps;
+
+    Totals local = Measure(), totals;
+    MPI_Reduce(&local, &totals, sizeof(Totals) / sizeof(double), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    double slowest;
+    MPI_Reduce(&ms, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    printf("rank %d: slab [%d, %d)   %.0f particles\n", rank, SlabFirst(), SlabLast(), local.count);
+    fflush(stdout);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    int failed = 0;
+    if (rank == 0) {
+        printf("%d ranks, %d threads each, %d steps, domain %dx%dx%d\n", ranks, SolverPool().Size(), steps,
+               glm::max(domain_size.x, grid_res), glm::max(domain_size.y, grid_res),
+               glm::max(domain_size.z, grid_res));
+        Report("distributed", totals, slowest);
+        if (check) {
+            Report("single", reference, reference_ms);
+            double drift = 0.0;
+            for (int a = 0; a < 3; ++a)
+                drift = std::max(drift, std::abs(totals.pos[a] / totals.count - reference.pos[a] / reference.count));
+            double kinetic = std::abs(totals.kinetic_energy - reference.kinetic_energy) / reference.kinetic_energy;
+            failed = std::abs(totals.mass - reference.mass) > 1e-3 ||
+                     (!resample_particles && (totals.count != reference.count || drift > 1e-4 || kinetic > 1e-4));
+            printf("check %s: mean pos %.2e cells apart, kinetic %.2e relative\n", failed ? "FAILED" : "ok",
+                   drift, kinetic);
+        }
+    }
+    MPI_Bcast(&failed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Finalize();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#include "SnapshotChannel.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+// Reads the snapshots a solver publishes (snapshot= in the benchmark, or
+// snapshot_channel), from another process, in place. Prints the mean
+// position of each snapshot it gets to, in domain coordinates, and at the
+// end how many it read, how many the solver overwrote while they were read
+// (torn) and how many it never saw.
+// usage: mls-mpm-snapshots [/name] [delay=ms] [timeout=s]
+// delay= holds every snapshot that long before checking it, as a slow
+// reader would. The reader waits up to timeout= (5 s) for the channel, and
+// stops once no snapshot came for as long.
+
+int main(int argc, char** argv) {
+    std::string name = "/mls-mpm";
+    int delay_ms = 0;
+    double timeout = 5.0;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (!strncmp(arg, "delay=", 6))
+            delay_ms = std::atoi(arg + 6);
+        else if (!strncmp(arg, "timeout=", 8))
+            timeout = std::atof(arg + 8);
+        else
+            name = arg;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    auto idle_since = Clock::now();
+    auto idle = [&]() { return std::chrono::duration<double>(Clock::now() - idle_since).count() > timeout; };
+
+    SnapshotReader reader;
+    while (!reader.Open(name)) {
+        if (idle()) {
+            fprintf(stderr, "no channel %s\n", name.c_str());
+            return EXIT_FAILURE;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    uint64_t read = 0, torn = 0, missed = 0;
+    uint64_t next = 0; // Number of the first snapshot not seen yet
+    idle_since = Clock::now();
+    while (!idle()) {
+        SnapshotView view;
+        if (!reader.Latest(view) || view.Number() < next) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+        idle_since = Clock::now();
+        missed += view.Number() - next;
+        next = view.Number() + 1;
+
+        const SnapshotSlot& slot = *view.slot;
+        uint64_t step = slot.step;
+        uint32_t count = slot.count, stride = slot.stride;
+        // Fields of a slot being overwritten can be anything
+        if (count == 0 || stride < 3 * sizeof(float) || (uint64_t)count * stride > reader.Capacity()) {
+            torn += !reader.Check(view);
+            continue;
+        }
+        double mean[3] = {0.0, 0.0, 0.0};
+        for (int a = 0; a < 3; ++a)
+            mean[a] = slot.origin[a] * (double)count;
+        const char* data = (const char*)slot.Particles();
+        for (uint32_t i = 0; i < count; ++i) {
+            float pos[3];
+            std::memcpy(pos, data + (size_t)i * stride, sizeof(pos));
+            for (int a = 0; a < 3; ++a)
+                mean[a] += pos[a];
+        }
+        if (delay_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+        if (!reader.Check(view)) {
+            torn++;
+            continue;
+        }
+        read++;
+        printf("snapshot %llu   step %llu   %u particles   mean pos (%.4f, %.4f, %.4f)\n",
+               (unsigned long long)view.Number(), (unsigned long long)step, count,
+               mean[0] / count, mean[1] / count, mean[2] / count);
+    }
+    printf("%llu read, %llu torn, %llu missed\n", (unsigned long long)read, (unsigned long long)torn,
+           (unsigned long long)missed);
+    return EXIT_SUCCESS;
+}
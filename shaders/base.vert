@@ -3,9 +3,11 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aVel;
 
+uniform vec3 origin; // Of the grid window, particle positions are relative to it
+
 out vec3 Velocity;
 
 void main() {
-    gl_Position = vec4(aPos, 1.0);
+    gl_Position = vec4(aPos + origin, 1.0);
     Velocity = aVel;
 }
\ No newline at end of file
@@ -0,0 +1,28 @@
+# version 460 core
+
+// Mirrors struct Particle in Simulation.hpp (17 floats)
+struct Particle {
+    float pos[3];
+    float vel[3];
+    float C[9];
+    float J;
+    float mass;
+};
+
+layout (std430, binding = 0) readonly buffer Particles {
+    Particle particles[];
+};
+
+layout (std430, binding = 1) readonly buffer Visible {
+    uint visible[];
+};
+
+uniform vec3 origin; // Of the grid window, particle positions are relative to it
+
+out vec3 Velocity;
+
+void main() {
+    Particle p = particles[visible[gl_VertexID]];
+    gl_Position = vec4(vec3(p.pos[0], p.pos[1], p.pos[2]) + origin, 1.0);
+    Velocity = vec3(p.vel[0], p.vel[1], p.vel[2]);
+}
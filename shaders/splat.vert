@@ -0,0 +1,14 @@
+# version 460 core
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aVel;
+layout (location = 2) in float aSize;
+
+out vec3 Velocity;
+out float Size;
+
+void main() {
+    gl_Position = vec4(aPos, 1.0);
+    Velocity = aVel;
+    Size = aSize;
+}
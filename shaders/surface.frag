@@ -0,0 +1,11 @@
+# version 460 core
+
+out vec4 FragColor;
+in vec3 Normal;
+
+uniform vec3 light_dir;
+
+void main() {
+    float diffuse = abs(dot(normalize(Normal), -light_dir));
+    FragColor = vec4(vec3(0.0588, 0.3137, 0.8667) * (0.25 + 0.75 * diffuse), 1.0);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "PageAllocator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Array carved out of an Arena, valid until the arena's next Reset()
+template <typename T>
+struct Span {
+    T* data = nullptr;
+    size_t count = 0;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t i) const { return data[i]; }
+    T* begin() const { return data; }
+    T* end() const { return data + count; }
+};
+
+// Blocks the arenas have added so far, chained or merged
+inline std::atomic<uint64_t> arena_blocks {0};
+
+// Bump pointer allocator for the temporaries of one step. Allocations are
+// never freed one by one, Reset() releases all of them at once. Running out
+// of room chains another block; the next Reset() merges the chain into one
+// block of the total size, so after the first steps a step allocates
+// nothing from the heap.
+class Arena {
+public:
+    Arena(size_t capacity = 1 << 20) {
+        addBlock(capacity);
+    }
+
+    ~Arena() {
+        for (const Block& block: blocks)
+            PageAllocator<char>().deallocate(block.data, block.size);
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+        Block& block = blocks.back();
+        size_t offset = (used + align - 1) / align * align;
+        if (offset + bytes > block.size) {
+            addBlock(std::max(bytes + align, 2 * block.size));
+            return Allocate(bytes, align);
+        }
+        used = offset + bytes;
+        total += bytes;
+        return block.data + offset;
+    }
+
+    // `count` default-initialized elements, T should be trivially destructible
+    template <typename T>
+    Span<T> Allocate(size_t count) {
+        T* data = (T*)Allocate(count * sizeof(T), alignof(T));
+        for (size_t i = 0; i < count; ++i)
+            ::new((void*)&data[i]) T;
+        return {data, count};
+    }
+
+    template <typename T>
+    Span<T> Allocate(size_t count, const T& value) {
+        Span<T> span = Allocate<T>(count);
+        for (T& element: span)
+            element = value;
+        return span;
+    }
+
+    void Reset() {
+        if (blocks.size() > 1) {
+            size_t size = 0;
+            for (const Block& block: blocks) {
+                size += block.size;
+                PageAllocator<char>().deallocate(block.data, block.size);
+            }
+            blocks.clear();
+            addBlock(size);
+        }
+        used = 0;
+        total = 0;
+    }
+
+    // Bytes handed out since the last Reset()
+    size_t Used() const { return total; }
+    size_t Capacity() const {
+        size_t size = 0;
+        for (const Block& block: blocks)
+            size += block.size;
+        return size;
+    }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t used = 0;  // In the last block
+    size_t total = 0;
+
+    void addBlock(size_t size) {
+        blocks.push_back({PageAllocator<char>().allocate(size), size});
+        used = 0;
+        arena_blocks.fetch_add(1, std::memory_order_relaxed);
+    }
+};
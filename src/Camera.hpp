@@ -5,6 +5,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <array>
 #include <vector>
 #include <numeric>
 
@@ -44,7 +45,11 @@ public:
     inline glm::mat4 GetProjection() const {
         return projection;
     }
-    
+
+    // Left, right, bottom, top, near, far planes as (normal, distance),
+    // normalized so that dot(plane.xyz, p) + plane.w is a world distance.
+    std::array<glm::vec4, 6> GetFrustumPlanes() const;
+
 private:
 
     GLFWwindow* Window;
@@ -162,6 +167,23 @@ void Camera::updateCamera() {
     
 }
 
+std::array<glm::vec4, 6> Camera::GetFrustumPlanes() const {
+    glm::mat4 m = GetViewProjection();
+    glm::vec4 row0 = glm::vec4(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1 = glm::vec4(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2 = glm::vec4(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3 = glm::vec4(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+    std::array<glm::vec4, 6> planes = {
+        row3 + row0, row3 - row0,
+        row3 + row1, row3 - row1,
+        row3 + row2, row3 - row2
+    };
+    for (auto& plane: planes)
+        plane /= glm::length(glm::vec3(plane));
+    return planes;
+}
+
 void Camera::setSensitivity(float sensitivity) {
     mouseSensitivity = sensitivity;
 }
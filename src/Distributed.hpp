@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Simulation.hpp"
+
+// Runs the solver over the ranks of MPI_COMM_WORLD, one process per rank,
+// each of them with its own pool. The domain is cut into slabs along x, one
+// per rank in rank order, and a rank only stores its slab's particles and
+// grid: its grid window covers the slab plus a halo of Kernel::reach + 2
+// cells on each side shared with another slab, which holds its particles'
+// stencils and the particles leaving the slab until they migrate. Every step the ranks send
+// the P2G sums of their halo to the neighbour owning those cells, and the
+// updated velocities of their slab's edges back into the neighbours' halo.
+// The sends are posted before the cells and particles that do not need
+// them are worked on, and waited for after. Particles that left the slab
+// move to the neighbour at the end of the step.
+//
+// Configure the solver as for Init(); a distributed run uses the whole
+// domain (domain_size, at least grid_res), not the moving window, and
+// ignores the settings no rank could apply alone: PRESSURE_IMPLICIT, fused
+// transfers, sleeping blocks and grid levels. Each slab needs to be at
+// least two halos wide. Particle positions and cell coordinates are
+// relative to GridOrigin(), `particles` holds the rank's particles after
+// SyncParticles().
+//
+// Only built by the MPI compiler wrappers, see README. MPI must be
+// initialized, at least MPI_THREAD_FUNNELED: only the thread calling
+// SimulateDistributed() communicates.
+
+// Init(seed) then keeps the particles of the rank's slab, every rank has to
+// pass the same seed
+void InitDistributed(unsigned int seed);
+void SimulateDistributed();
+
+// Domain cells along x of the rank's slab, [first, last)
+int SlabFirst();
+int SlabLast();
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "Camera.hpp"
+#include "ResourceManager.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <string>
+
+struct DrawArraysIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+};
+
+// Tests every particle of the particle buffer against the view frustum on
+// the GPU and compacts the survivors' indices into a buffer, the draw count
+// is written straight into an indirect command so the CPU never reads it back.
+class FrustumCuller {
+public:
+    FrustumCuller(GLuint particleBuffer);
+    ~FrustumCuller();
+
+    // Grow the index buffer so it can hold `count` particles.
+    void Reserve(GLuint count);
+
+    // Also drop particles whose block level (one GLuint per block, see
+    // ParticleLOD) is non zero. A zero `blocks` disables the test.
+    void SetLevelOfDetail(GLuint levelBuffer, glm::ivec3 blocks, int blockSize);
+
+    // `radius` is the world space margin added around each particle, whose
+    // position is relative to `origin` (GridOrigin()).
+    void Cull(const Camera& camera, GLuint count, float radius, glm::vec3 origin);
+    void Draw();
+
+private:
+    static const GLuint groupSize = 256;
+
+    GLuint particleBuffer;
+    GLuint visibleBuffer;
+    GLuint indirectBuffer;
+    GLuint VAO;
+    GLuint capacity;
+
+    GLuint levelBuffer;
+    glm::ivec3 lodBlocks;
+    int lodBlockSize;
+};
+
+FrustumCuller::FrustumCuller(GLuint particleBuffer) {
+    this->particleBuffer = particleBuffer;
+    capacity = 0;
+    levelBuffer = 0;
+    lodBlocks = glm::ivec3(0);
+    lodBlockSize = 1;
+
+    // Core profile needs a VAO bound even though vertices are pulled from SSBOs
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &visibleBuffer);
+    glGenBuffers(1, &indirectBuffer);
+
+    DrawArraysIndirectCommand command = {0, 1, 0, 0};
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(command), &command, GL_DYNAMIC_DRAW);
+
+    ResourceManager::LoadComputeShader("cull", "shaders/cull.comp");
+    ResourceManager::LoadShader("culled", "shaders/culled.vert",
+                                          "shaders/base.frag",
+                                          "shaders/base.geom");
+}
+
+FrustumCuller::~FrustumCuller() {
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &visibleBuffer);
+    glDeleteBuffers(1, &indirectBuffer);
+}
+
+void FrustumCuller::Reserve(GLuint count) {
+    if (count <= capacity)
+        return;
+    capacity = count;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+}
+
+void FrustumCuller::SetLevelOfDetail(GLuint levelBuffer, glm::ivec3 blocks, int blockSize) {
+    this->levelBuffer = levelBuffer;
+    lodBlocks = blocks;
+    lodBlockSize = blockSize;
+}
+
+void FrustumCuller::Cull(const Camera& camera, GLuint count, float radius, glm::vec3 origin) {
+    Reserve(count);
+
+    // Reset the draw count, the shader appends to it
+    DrawArraysIndirectCommand command = {0, 1, 0, 0};
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(command), &command);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visibleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, indirectBuffer);
+    bool lod = lodBlocks.x * lodBlocks.y * lodBlocks.z > 0;
+    if (lod)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, levelBuffer);
+
+    auto planes = camera.GetFrustumPlanes();
+    ComputeShader cull = ResourceManager::GetComputeShader("cull");
+    cull.Use();
+    for (int i = 0; i < 6; ++i)
+        cull.SetVector4f(("planes[" + std::to_string(i) + "]").c_str(), planes[i]);
+    cull.SetInteger("particle_count", count);
+    cull.SetFloat("radius", radius);
+    cull.SetVector3f("origin", origin);
+    cull.SetInteger("lod", lod);
+    cull.SetVector3f("lod_blocks", glm::vec3(lodBlocks));
+    cull.SetInteger("lod_block_size", lodBlockSize);
+
+    glDispatchCompute((count + groupSize - 1) / groupSize, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void FrustumCuller::Draw() {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visibleBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+
+    glBindVertexArray(VAO);
+    glDrawArraysIndirect(GL_POINTS, 0);
+    glBindVertexArray(0);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Cell index mappings for the simulation grid. The transfer kernels are
+// templated on the layout, a stencil of Width^3 cells is addressed as
+// Index(base) plus the offsets returned by Stencil<Width>(base), in gx, gy,
+// gz loop order. Widths 2 to 4 cover the linear to cubic B-splines.
+
+const int max_stencil_width = 4;
+
+// Writes the offsets of the cells of a Width^3 stencil from its base cell,
+// for the given cell indexing
+template <typename IndexOf>
+void StencilOffsets(uint32_t width, glm::uvec3 base, IndexOf index, int32_t* offsets) {
+    for (uint32_t gx = 0; gx < width; ++gx)
+        for (uint32_t gy = 0; gy < width; ++gy)
+            for (uint32_t gz = 0; gz < width; ++gz)
+                *offsets++ = (int32_t)index(base + glm::uvec3(gx, gy, gz)) - (int32_t)index(base);
+}
+
+// Row-major: x + (y + z * size.y) * size.x
+struct LinearLayout {
+    glm::ivec3 size;
+    std::vector<int32_t> stencils[max_stencil_width + 1]; // By width
+
+    LinearLayout(glm::ivec3 size) {
+        Assign(size);
+    }
+
+    // Resizes the layout in place, reusing the tables' memory
+    void Assign(glm::ivec3 size) {
+        this->size = size;
+        for (int width = 2; width <= max_stencil_width; ++width) {
+            stencils[width].resize(width * width * width);
+            StencilOffsets(width, glm::uvec3(0), [this](glm::uvec3 cell) {
+                return Index(cell);
+            }, stencils[width].data());
+        }
+    }
+
+    size_t Size() const {
+        return (size_t)size.x * size.y * size.z;
+    }
+
+    uint32_t Index(uint32_t x, uint32_t y, uint32_t z) const {
+        return x + (y + z * size.y) * size.x;
+    }
+
+    uint32_t Index(glm::uvec3 cell) const {
+        return Index(cell.x, cell.y, cell.z);
+    }
+
+    template <int Width>
+    const int32_t* Stencil(glm::uvec3) const {
+        return stencils[Width].data();
+    }
+};
+
+// Bricks of 4^3 cells stored contiguously, bricks in row-major order, so a
+// 3x3x3 stencil spans at most 8 bricks of 256 bytes of cells instead of 9
+// rows strided by a whole slice. The offsets of a stencil only depend on where its
+// base cell sits within its brick, hence one table per brick position (and
+// stencil width).
+struct TiledLayout {
+    static const int brick = 4;
+
+    glm::ivec3 size;
+    glm::ivec3 bricks;
+    std::vector<int32_t> stencils[max_stencil_width + 1]; // By width, then brick position
+
+    TiledLayout(glm::ivec3 size) {
+        Assign(size);
+    }
+
+    // Resizes the layout in place, reusing the tables' memory. The offsets
+    // crossing into the next bricks depend on the bricks per row and slice.
+    void Assign(glm::ivec3 size) {
+        this->size = size;
+        bricks = (size + brick - 1) / brick;
+        for (int width = 2; width <= max_stencil_width; ++width) {
+            int cells = width * width * width;
+            stencils[width].resize(cells * brick * brick * brick);
+            for (uint32_t lz = 0; lz < brick; ++lz) {
+                for (uint32_t ly = 0; ly < brick; ++ly) {
+                    for (uint32_t lx = 0; lx < brick; ++lx) {
+                        glm::uvec3 base = glm::uvec3(lx, ly, lz);
+                        StencilOffsets(width, base, [this](glm::uvec3 cell) {
+                            return Index(cell);
+                        }, &stencils[width][cells * local(base)]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Cells past `size` pad the last bricks and are never touched by particles
+    size_t Size() const {
+        return (size_t)bricks.x * bricks.y * bricks.z * brick * brick * brick;
+    }
+
+    uint32_t Index(uint32_t x, uint32_t y, uint32_t z) const {
+        uint32_t b = (x / brick) + ((y / brick) + (z / brick) * bricks.y) * bricks.x;
+        return b * brick * brick * brick + local(glm::uvec3(x, y, z));
+    }
+
+    uint32_t Index(glm::uvec3 cell) const {
+        return Index(cell.x, cell.y, cell.z);
+    }
+
+    template <int Width>
+    const int32_t* Stencil(glm::uvec3 base) const {
+        return &stencils[Width][Width * Width * Width * local(base)];
+    }
+
+private:
+    static uint32_t local(glm::uvec3 cell) {
+        return (cell.x % brick) + (cell.y % brick) * brick + (cell.z % brick) * brick * brick;
+    }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+
+// 16-bit storage formats for solver state that tolerates the rounding. Only
+// storage: values are converted to float on load and all the math stays in
+// fp32. Conversions are plain integer code, so they build for any target.
+
+// IEEE binary16: 11 bits of mantissa, range +-65504
+struct Half {
+    uint16_t bits;
+
+    Half() = default;
+    Half(float value) : bits(FromFloat(value)) {}
+    operator float() const { return ToFloat(bits); }
+
+    // Rounds to nearest even, overflow gives infinity
+    static uint16_t FromFloat(float value) {
+        uint32_t f = asBits(value);
+        uint32_t sign = (f >> 16) & 0x8000;
+        f &= 0x7fffffff;
+
+        if (f >= (127 + 16) << 23) // Past the half range, or inf / nan
+            return sign | (f > 0x7f800000 ? 0x7e00 : 0x7c00);
+        if (f < 113 << 23) {
+            // Subnormal half: the add aligns the mantissa, rounding with it
+            const uint32_t magic = ((127 - 15) + (23 - 10) + 1) << 23;
+            return sign | (uint16_t)(asBits(asFloat(f) + asFloat(magic)) - magic);
+        }
+        uint32_t odd = (f >> 13) & 1;
+        f -= (127 - 15) << 23; // Rebias the exponent
+        f += 0xfff + odd;
+        return sign | (uint16_t)(f >> 13);
+    }
+
+    static float ToFloat(uint16_t bits) {
+        const uint32_t exponent_mask = 0x7c00 << 13;
+        uint32_t f = (uint32_t)(bits & 0x7fff) << 13;
+        uint32_t exponent = f & exponent_mask;
+        f += (127 - 15) << 23;
+        if (exponent == exponent_mask) {
+            f += (128 - 16) << 23; // inf / nan
+        } else if (exponent == 0) {
+            f += 1 << 23;          // Subnormal, renormalized by the subtraction
+            f = asBits(asFloat(f) - asFloat(113 << 23));
+        }
+        return asFloat(f | (uint32_t)(bits & 0x8000) << 16);
+    }
+
+private:
+    static uint32_t asBits(float value) { uint32_t f; std::memcpy(&f, &value, 4); return f; }
+    static float asFloat(uint32_t f) { float value; std::memcpy(&value, &f, 4); return value; }
+};
+
+// Upper half of a float: 8 bits of mantissa, the full float range
+struct BFloat16 {
+    uint16_t bits;
+
+    BFloat16() = default;
+    BFloat16(float value) : bits(FromFloat(value)) {}
+    operator float() const { return ToFloat(bits); }
+
+    // Rounds to nearest even, nan is not preserved
+    static uint16_t FromFloat(float value) {
+        uint32_t f;
+        std::memcpy(&f, &value, 4);
+        return (uint16_t)((f + 0x7fff + ((f >> 16) & 1)) >> 16);
+    }
+
+    static float ToFloat(uint16_t bits) {
+        uint32_t f = (uint32_t)bits << 16;
+        float value;
+        std::memcpy(&value, &f, 4);
+        return value;
+    }
+};
+
+template <typename Scalar>
+struct PackedVec3 {
+    Scalar x, y, z;
+
+    PackedVec3() = default;
+    PackedVec3(const glm::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+    operator glm::vec3() const { return glm::vec3(x, y, z); }
+};
+
+// Column major like glm::mat3
+template <typename Scalar>
+struct PackedMat3 {
+    Scalar m[9];
+
+    PackedMat3() = default;
+    PackedMat3(const glm::mat3& a) {
+        for (int c = 0; c < 3; ++c)
+            for (int r = 0; r < 3; ++r)
+                m[c * 3 + r] = a[c][r];
+    }
+
+    operator glm::mat3() const {
+        glm::mat3 a;
+        for (int c = 0; c < 3; ++c)
+            for (int r = 0; r < 3; ++r)
+                a[c][r] = m[c * 3 + r];
+        return a;
+    }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "ThreadPool.hpp"
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+enum HugePages {
+    HUGE_PAGES_OFF,         // 4 KB pages
+    HUGE_PAGES_TRANSPARENT, // madvise(MADV_HUGEPAGE), the kernel promotes when it can
+    HUGE_PAGES_EXPLICIT     // MAP_HUGETLB from the reserved pool, 4 KB pages if it is empty
+};
+
+// Page backing of the next PageAllocator allocations
+inline HugePages huge_pages = HUGE_PAGES_OFF;
+
+// Mappings made by PageAllocator so far, arena blocks included
+inline std::atomic<uint64_t> page_allocations {0};
+
+// Allocator for the big solver arrays. Memory is mapped straight from the
+// kernel and elements are default-initialized, so a vector of trivial
+// elements is left untouched when it grows: no page is placed until
+// something writes it, and under the default first-touch policy it lands
+// on the NUMA node of that thread. Fill them with FirstTouch().
+template <typename T>
+struct PageAllocator {
+    using value_type = T;
+
+    static const size_t page = 4096;
+    static const size_t huge_page = 2 << 20;
+
+    PageAllocator() = default;
+    template <typename U>
+    PageAllocator(const PageAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        size_t bytes = Rounded(n);
+        void* data = MAP_FAILED;
+        if (huge_pages == HUGE_PAGES_EXPLICIT && bytes % huge_page == 0)
+            data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data == MAP_FAILED)
+            data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            throw std::bad_alloc();
+        if (huge_pages == HUGE_PAGES_TRANSPARENT)
+            madvise(data, bytes, MADV_HUGEPAGE);
+        page_allocations.fetch_add(1, std::memory_order_relaxed);
+        return (T*)data;
+    }
+
+    void deallocate(T* data, size_t n) {
+        munmap(data, Rounded(n));
+    }
+
+    // Default rather than value initialization, leaves the pages alone
+    template <typename U>
+    void construct(U* p) {
+        ::new((void*)p) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    // Arrays of at least a huge page are rounded to huge pages whatever the
+    // mode, so the length to unmap only depends on n
+    static size_t Rounded(size_t n) {
+        size_t bytes = n * sizeof(T);
+        size_t granularity = bytes >= huge_page ? huge_page : page;
+        return (bytes + granularity - 1) / granularity * granularity;
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PageAllocator<T>&, const PageAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PageAllocator<T>&, const PageAllocator<U>&) { return false; }
+
+template <typename T>
+using PageVector = std::vector<T, PageAllocator<T>>;
+
+// Reallocates `v` with `size` elements v[i] = at(i), each worker writing the
+// slice [w * size / workers, (w + 1) * size / workers), which is also the
+// slice ThreadPool::ParallelFor hands it first
+template <typename T, typename F>
+void FirstTouch(ThreadPool& pool, PageVector<T>& v, size_t size, F at) {
+    v = PageVector<T>();
+    v.resize(size);
+    pool.ForEachWorker([&](int worker) {
+        size_t first = worker * size / pool.Size();
+        size_t last = (worker + 1) * size / pool.Size();
+        for (size_t i = first; i < last; ++i)
+            v[i] = at(i);
+    });
+}
+
+template <typename T>
+void FirstTouch(ThreadPool& pool, PageVector<T>& v, size_t size, const T& value) {
+    FirstTouch(pool, v, size, [&value](size_t) { return value; });
+}
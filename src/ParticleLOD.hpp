@@ -0,0 +1,175 @@
+#pragma once
+
+#include "Camera.hpp"
+#include "ResourceManager.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+struct Splat {
+    glm::vec3 pos;
+    glm::vec3 vel;
+    float size;
+};
+
+enum LODLevel : GLuint {
+    LOD_PARTICLES = 0, // Every particle of the block is drawn
+    LOD_CELLS     = 1, // One splat per occupied cell
+    LOD_BLOCK     = 2  // One splat for the whole block
+};
+
+// Picks a level of detail per grid block from its projected size and builds
+// splats out of the grid mass/velocity for the blocks that are far enough.
+// Particles of aggregated blocks are then discarded by the culling pass.
+class ParticleLOD {
+public:
+    // Blocks are blockSize^3 cells, aggregated once a cell (or a block) covers
+    // less than `pixels` pixels on screen.
+    ParticleLOD(int blockSize, float restDensity, float pixels);
+    ~ParticleLOD();
+
+    // cellAt(x, y, z) returns the grid cell, whatever the grid layout, for
+    // cells of the `size` grid at `origin` in the domain (GridSize() and
+    // GridOrigin()). The splats are placed in domain coordinates.
+    template <typename CellAt>
+    void Update(CellAt cellAt, glm::ivec3 origin, glm::ivec3 size, const Camera& camera, int viewportHeight);
+    void Draw();
+
+    // Blocks of the grid as of the last Update(), levels in x-major order
+    GLuint GetLevelBuffer() const { return levelBuffer; }
+    glm::ivec3 GetBlocks() const { return blocks; }
+    int GetBlockSize() const { return blockSize; }
+    size_t GetSplatCount() const { return splats.size(); }
+
+private:
+    int blockSize;
+    glm::ivec3 blocks;
+    float restDensity;
+    float pixels;
+
+    std::vector<GLuint> levels;
+    std::vector<Splat> splats;
+
+    GLuint levelBuffer;
+    GLuint VAO, VBO;
+
+    // Half size of the splat covering `mass` worth of fluid at rest density
+    float splatSize(float mass, float scale) const {
+        return 0.5f * std::cbrt(mass / restDensity) * scale;
+    }
+};
+
+ParticleLOD::ParticleLOD(int blockSize, float restDensity, float pixels) {
+    this->blockSize = blockSize;
+    this->blocks = glm::ivec3(0);
+    this->restDensity = restDensity;
+    this->pixels = pixels;
+
+    glGenBuffers(1, &levelBuffer);
+
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Splat), (GLvoid*)offsetof(Splat, pos));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Splat), (GLvoid*)offsetof(Splat, vel));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(Splat), (GLvoid*)offsetof(Splat, size));
+    glEnableVertexAttribArray(2);
+    glBindVertexArray(0);
+
+    ResourceManager::LoadShader("splat", "shaders/splat.vert",
+                                         "shaders/base.frag",
+                                         "shaders/splat.geom");
+}
+
+ParticleLOD::~ParticleLOD() {
+    glDeleteBuffers(1, &levelBuffer);
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &VBO);
+}
+
+template <typename CellAt>
+void ParticleLOD::Update(CellAt cellAt, glm::ivec3 origin, glm::ivec3 size, const Camera& camera,
+                         int viewportHeight) {
+    splats.clear();
+
+    // The grid window moves and resizes with moving_window
+    glm::ivec3 fitted = (size + blockSize - 1) / blockSize;
+    bool resized = fitted != blocks;
+    blocks = fitted;
+    levels.resize(blocks.x * blocks.y * blocks.z);
+
+    // Pixels covered by one world unit at unit distance
+    float scale = camera.GetProjection()[1][1];
+    float pixelsPerUnit = 0.5f * viewportHeight * scale;
+
+    for (int bz = 0; bz < blocks.z; ++bz) {
+        for (int by = 0; by < blocks.y; ++by) {
+            for (int bx = 0; bx < blocks.x; ++bx) {
+                glm::ivec3 lo = glm::ivec3(bx, by, bz) * blockSize;
+                glm::ivec3 hi = glm::min(lo + blockSize, size);
+
+                glm::vec3 center = glm::vec3(origin) + (glm::vec3(lo) + glm::vec3(hi)) * 0.5f;
+                float dist = std::max(glm::length(center - camera.position), 1e-3f);
+                float blockPixels = blockSize * pixelsPerUnit / dist;
+
+                GLuint level = LOD_PARTICLES;
+                if (blockPixels < pixels)
+                    level = LOD_BLOCK;
+                else if (blockPixels < pixels * blockSize)
+                    level = LOD_CELLS;
+                levels[bx + (by + bz * blocks.y) * blocks.x] = level;
+                if (level == LOD_PARTICLES)
+                    continue;
+
+                float blockMass = 0.0f;
+                glm::vec3 blockPos = glm::vec3(0.0f);
+                glm::vec3 blockVel = glm::vec3(0.0f);
+                for (int z = lo.z; z < hi.z; ++z) {
+                    for (int y = lo.y; y < hi.y; ++y) {
+                        for (int x = lo.x; x < hi.x; ++x) {
+                            const auto& cell = cellAt(x, y, z);
+                            if (cell.mass <= 0.0f)
+                                continue;
+                            // Grid nodes sit at the center of the cells
+                            glm::vec3 node = glm::vec3(origin + glm::ivec3(x, y, z)) + 0.5f;
+                            if (level == LOD_CELLS) {
+                                splats.push_back({node, cell.vel, splatSize(cell.mass, scale)});
+                            } else {
+                                blockMass += cell.mass;
+                                blockPos += cell.mass * node;
+                                blockVel += cell.mass * cell.vel;
+                            }
+                        }
+                    }
+                }
+                if (level == LOD_BLOCK && blockMass > 0.0f)
+                    splats.push_back({blockPos / blockMass, blockVel / blockMass,
+                                      splatSize(blockMass, scale)});
+            }
+        }
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, levelBuffer);
+    if (resized)
+        glBufferData(GL_SHADER_STORAGE_BUFFER, levels.size() * sizeof(GLuint), levels.data(), GL_DYNAMIC_DRAW);
+    else
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, levels.size() * sizeof(GLuint), levels.data());
+
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, splats.size() * sizeof(Splat), splats.data(), GL_STREAM_DRAW);
+}
+
+void ParticleLOD::Draw() {
+    if (splats.empty())
+        return;
+    glBindVertexArray(VAO);
+    glDrawArrays(GL_POINTS, 0, splats.size());
+    glBindVertexArray(0);
+}
@@ -0,0 +1,700 @@
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "SimulationState.hpp"
+#include "SnapshotChannel.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+float dt = 0.30f;
+float eos_stiffness = 10.0f;
+
+PageVector<Particle> particles;
+Grid grid;
+
+GridLayout grid_layout = GRID_TILED;
+LinearLayout linear_layout {glm::ivec3(grid_res)};
+TiledLayout tiled_layout {glm::ivec3(grid_res)};
+
+GridLayout layout_in_use = GRID_TILED;
+
+glm::ivec3 domain_size = glm::ivec3(grid_res);
+bool moving_window = false;
+int window_margin = 4;
+glm::ivec3 domain_in_use = glm::ivec3(grid_res);
+glm::ivec3 grid_origin = glm::ivec3(0);
+glm::ivec3 grid_size = glm::ivec3(grid_res);
+glm::ivec3 grid_blocks = (grid_size + block_size - 1) / block_size;
+static bool window_in_use = false;
+
+std::vector<uint8_t> block_active;
+std::vector<uint32_t> active_blocks;
+
+P2GMode p2g_mode = P2G_SCATTER;
+FluidModel fluid_model = FLUID_GATHER;
+
+// Scratch of the current step, reset at the start of every Simulate()
+Arena step_arena;
+static std::vector<std::unique_ptr<Arena>> worker_arenas;
+uint64_t step_count = 0;
+
+int solver_threads = 0;
+bool pin_threads = false;
+std::unique_ptr<ThreadPool> pool;
+static bool pool_pinned = false;
+
+// Second grid of the fused transfers and its active blocks, see FusedTransfer()
+Grid back_grid;
+std::vector<uint8_t> back_block_active;
+std::vector<uint32_t> back_active_blocks;
+bool fused_transfers = false;
+bool fused_in_use = false;
+bool fused_primed = false;
+
+// Particle indices sorted by the block of their cell, the particles of block
+// b are bin_particles[bin_offsets[b] .. bin_offsets[b + 1]]. Rebuilt every
+// step in the step arena.
+Span<uint32_t> bin_offsets;
+Span<uint32_t> bin_particles;
+Span<uint32_t> particle_bin;
+Span<uint32_t> occupied_bins;
+
+FixedGrid fixed_grid;
+bool deterministic_p2g = false;
+bool deterministic_in_use = false;
+
+bool task_graph = false;
+
+TransferScheme transfer_scheme = TRANSFER_APIC;
+float flip_blend = 0.95f;
+TransferScheme transfer_in_use = TRANSFER_APIC;
+
+KernelOrder kernel_order = KERNEL_QUADRATIC;
+KernelOrder kernel_order_in_use = KERNEL_QUADRATIC;
+
+PressureSolver pressure_solver = PRESSURE_EXPLICIT;
+int pressure_max_iterations = 50;
+float pressure_tolerance = 1e-2f;
+PressureSolver pressure_in_use = PRESSURE_EXPLICIT;
+int pressure_iterations = 0;
+
+bool resample_particles = false;
+int resample_interval = 10;
+int min_particles_per_cell = 4;
+int max_particles_per_cell = 16;
+static bool resample_in_use = false;
+// The resampling settings of the last Init(): a cell keeps at least one
+// particle, and splits never make more than merges allow
+static int resample_interval_in_use = 10;
+static int min_per_cell_in_use = 4;
+static int max_per_cell_in_use = 16;
+
+bool sleeping_blocks = false;
+float sleep_velocity = 0.03f;
+float wake_velocity = 0.06f;
+float sleep_mass_change = 0.01f;
+int sleep_steps = 20;
+bool sleep_in_use = false;
+std::vector<BlockRest> block_rest;
+
+int grid_levels = 1;
+float refine_velocity = 2.0f;
+int fine_block_budget = 0;
+bool levels_in_use = false;
+Grid coarse_grid;
+std::vector<uint8_t> coarse_block_active;
+std::vector<uint32_t> coarse_active_blocks;
+glm::ivec3 coarse_size = glm::ivec3(0);
+glm::ivec3 coarse_blocks = glm::ivec3(0);
+LinearLayout coarse_linear_layout {glm::ivec3(0)};
+TiledLayout coarse_tiled_layout {glm::ivec3(0)};
+std::vector<uint8_t> block_level;
+int fine_blocks = 0;
+
+SlabExchange* slab_exchange = nullptr;
+
+std::string snapshot_channel;
+int snapshot_slots = 4;
+static SnapshotWriter snapshot_writer;
+static bool snapshot_overflowed = false; // Reported a step too large for the slots
+
+Precision affine_precision = PRECISION_FP32;
+bool packed_velocity = false;
+bool half_grid_velocity = false;
+Precision affine_in_use = PRECISION_FP32;
+bool packed_velocity_in_use = false;
+bool half_grid_in_use = false;
+
+SimdLevel simd_level = SIMD_AUTO;
+static SimdLevel simd_in_use = SIMD_GENERIC;
+static void (*step_kernel)() = generic::Step;
+
+static bool SimdSupported(SimdLevel level) {
+#if defined(__x86_64__)
+    switch (level) {
+    case SIMD_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case SIMD_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case SIMD_AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+               __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq");
+    default:
+        break;
+    }
+#endif
+    return level == SIMD_GENERIC;
+}
+
+// Points step_kernel at the build of simd_level, or of the widest level
+// the CPU supports
+static void SelectKernels() {
+    SimdLevel level = simd_level;
+    if (level != SIMD_AUTO && !SimdSupported(level)) {
+        std::cerr << "SIMD level " << SimdLevelName(level)
+                  << " not supported by this CPU, using the widest available" << std::endl;
+        level = SIMD_AUTO;
+    }
+    if (level == SIMD_AUTO) {
+        level = SIMD_AVX512;
+        while (!SimdSupported(level))
+            level = (SimdLevel)(level - 1);
+    }
+
+    simd_in_use = level;
+    switch (level) {
+#if defined(__x86_64__)
+    case SIMD_SSE42:  step_kernel = sse42::Step;  break;
+    case SIMD_AVX2:   step_kernel = avx2::Step;   break;
+    case SIMD_AVX512: step_kernel = avx512::Step; break;
+#endif
+    default:          step_kernel = generic::Step; break;
+    }
+}
+
+SimdLevel SimdLevelInUse() {
+    return simd_in_use;
+}
+
+const char* SimdLevelName(SimdLevel level) {
+    switch (level) {
+    case SIMD_AUTO:    return "auto";
+    case SIMD_GENERIC: return "generic";
+    case SIMD_SSE42:   return "sse4.2";
+    case SIMD_AVX2:    return "avx2";
+    case SIMD_AVX512:  return "avx512";
+    }
+    return "?";
+}
+
+// The grids start out zero with no block active
+void AssignGrid(ThreadPool& workers) {
+    grid_blocks = (grid_size + block_size - 1) / block_size;
+    if (layout_in_use == GRID_TILED) {
+        tiled_layout.Assign(grid_size);
+        grid.Assign(tiled_layout.Size(), workers, half_grid_in_use, transfer_in_use == TRANSFER_FLIP);
+    } else {
+        linear_layout.Assign(grid_size);
+        grid.Assign(linear_layout.Size(), workers, half_grid_in_use, transfer_in_use == TRANSFER_FLIP);
+    }
+    // A window never outgrows the domain, so room for the domain's blocks
+    // keeps its refits from reallocating the block lists
+    const glm::ivec3 domain_blocks = (domain_in_use + block_size - 1) / block_size;
+    const size_t most_blocks = (size_t)domain_blocks.x * domain_blocks.y * domain_blocks.z;
+    block_active.reserve(most_blocks);
+    block_rest.reserve(most_blocks);
+    block_level.reserve(most_blocks);
+    block_active.assign(BlockCount(), 0);
+    block_rest.assign(block_active.size(), {});
+    active_blocks.clear();
+
+    active_blocks.reserve(most_blocks);
+
+    if (deterministic_in_use) {
+        fixed_grid.Assign(grid.mass.size(), workers, transfer_in_use == TRANSFER_FLIP);
+    } else {
+        fixed_grid.Assign(0, workers);
+    }
+
+    if (fused_in_use) {
+        back_grid.Assign(grid.mass.size(), workers, half_grid_in_use, transfer_in_use == TRANSFER_FLIP);
+        back_block_active.reserve(most_blocks);
+        back_block_active.assign(block_active.size(), 0);
+        back_active_blocks.reserve(most_blocks);
+    } else {
+        back_grid.Assign(0, workers);
+        back_block_active.clear();
+    }
+    back_active_blocks.clear();
+
+    // The coarse level covers the grid and its padding
+    if (levels_in_use) {
+        coarse_size = (grid_size + CoarseLevel::scale - 1) / CoarseLevel::scale + 2 * CoarseLevel::pad;
+        coarse_blocks = (coarse_size + block_size - 1) / block_size;
+        if (layout_in_use == GRID_TILED) {
+            coarse_tiled_layout.Assign(coarse_size);
+            coarse_grid.Assign(coarse_tiled_layout.Size(), workers, half_grid_in_use, transfer_in_use == TRANSFER_FLIP);
+        } else {
+            coarse_linear_layout.Assign(coarse_size);
+            coarse_grid.Assign(coarse_linear_layout.Size(), workers, half_grid_in_use, transfer_in_use == TRANSFER_FLIP);
+        }
+        const glm::ivec3 coarse_most = ((domain_in_use + CoarseLevel::scale - 1) / CoarseLevel::scale +
+                                        2 * CoarseLevel::pad + block_size - 1) / block_size;
+        coarse_block_active.reserve((size_t)coarse_most.x * coarse_most.y * coarse_most.z);
+        coarse_block_active.assign(coarse_blocks.x * coarse_blocks.y * coarse_blocks.z, 0);
+        coarse_active_blocks.reserve(coarse_block_active.capacity());
+    } else {
+        coarse_grid.Assign(0, workers);
+        coarse_block_active.clear();
+    }
+    coarse_active_blocks.clear();
+    block_level.clear();
+    fine_blocks = 0;
+}
+
+void Init(unsigned int seed) {
+    ThreadPool& workers = SolverPool();
+
+    std::vector<glm::vec3> tmp_pos;
+    const int box_x = 25, box_y = 16, box_z = 16;
+    const float sx = grid_res / 2.0f, sy = grid_res / 2.0f, sz = grid_res / 2.0f;
+    const float spacing = 0.5f;
+    for (float i = sx - box_x / 2; i < sx + box_x / 2; i += spacing) {
+        for (float j = sy - box_y / 2; j < sy + box_y / 2; j += spacing) {
+            for (float k = sz - box_z / 2; k < sz + box_z / 2; k += spacing) {
+                glm::vec3 pos = glm::vec3(i, j, k);
+                tmp_pos.push_back(pos);
+            }
+        }
+    }
+
+
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> rnd_rnd(-5.0, 5.0);
+    std::uniform_real_distribution<float> rnd_x(rnd_rnd(gen), rnd_rnd(gen));
+    std::uniform_real_distribution<float> rnd_y(rnd_rnd(gen), rnd_rnd(gen));
+    std::uniform_real_distribution<float> rnd_z(rnd_rnd(gen), rnd_rnd(gen));
+
+    // Volume ratio that gives the density of the initial sampling
+    const float initial_J = rest_density * spacing * spacing * spacing / particle_mass;
+
+    std::vector<Particle> initial;
+    for (unsigned int i = 0; i < tmp_pos.size(); ++i) {
+        initial.push_back({
+            .pos = tmp_pos[i],
+            .vel = glm::vec3(rnd_x(gen), 0.0f, rnd_z(gen)),
+            .C = glm::mat3(0.0f),
+            .J = initial_J,
+            .mass = particle_mass,
+        });
+    }
+    FirstTouch(workers, particles, initial.size(), [&initial](size_t i) { return initial[i]; });
+
+    // Compact storage of the previous run, if any
+    ParticleStorage<CompactParticle<Half, true>>() = {};
+    ParticleStorage<CompactParticle<Half, false>>() = {};
+    ParticleStorage<CompactParticle<BFloat16, true>>() = {};
+    ParticleStorage<CompactParticle<BFloat16, false>>() = {};
+    ParticleStorage<VelocityParticle>() = {};
+    transfer_in_use = transfer_scheme;
+    kernel_order_in_use = kernel_order;
+    // Compact particles are only built for the quadratic kernel
+    bool compact = kernel_order_in_use == KERNEL_QUADRATIC;
+    affine_in_use = compact ? affine_precision : PRECISION_FP32;
+    packed_velocity_in_use = compact && packed_velocity;
+    WithParticleStorage([&](auto* storage) {
+        using P = std::remove_pointer_t<decltype(storage)>;
+        if constexpr (!std::is_same_v<P, Particle>) {
+            FirstTouch(workers, ParticleStorage<P>(), initial.size(), [&initial](size_t i) {
+                P p;
+                Pack(p, initial[i]);
+                return p;
+            });
+        }
+    });
+
+    SelectKernels();
+
+    layout_in_use = grid_layout;
+    // The fluid starts in the middle of a grid_res^3 window at the domain's
+    // corner. A distributed run places the grid on its slab afterwards.
+    window_in_use = moving_window && !slab_exchange;
+    domain_in_use = window_in_use || slab_exchange ? glm::max(domain_size, glm::ivec3(grid_res))
+                                                   : glm::ivec3(grid_res);
+    grid_origin = glm::ivec3(0);
+    grid_size = glm::ivec3(grid_res);
+    // The CG's dot products would need every rank
+    pressure_in_use = slab_exchange ? PRESSURE_EXPLICIT : pressure_solver;
+    pressure_iterations = 0;
+    resample_in_use = resample_particles && resample_interval > 0;
+    resample_interval_in_use = resample_interval;
+    max_per_cell_in_use = std::max(max_particles_per_cell, 1);
+    min_per_cell_in_use = std::clamp(min_particles_per_cell, 0, max_per_cell_in_use);
+    half_grid_in_use = half_grid_velocity;
+
+    worker_arenas.clear();
+    for (int w = 0; w < workers.Slots(); ++w)
+        worker_arenas.push_back(std::make_unique<Arena>());
+    deterministic_in_use = deterministic_p2g;
+
+    fused_in_use = fused_transfers && volume_ratio() &&
+                   p2g_mode == P2G_SCATTER && !slab_exchange;
+    fused_primed = false;
+    sleep_in_use = sleeping_blocks && pressure_in_use == PRESSURE_EXPLICIT && !fused_in_use && !slab_exchange;
+    levels_in_use = grid_levels > 1 && pressure_in_use == PRESSURE_EXPLICIT && !fused_in_use && !slab_exchange;
+    AssignGrid(workers);
+
+    // Resampling bounds the count by the mass of the cells, which float sums
+    // round: a quarter of headroom over the initial particles
+    snapshot_overflowed = false;
+    if (!snapshot_channel.empty() && !slab_exchange) {
+        WithParticleStorage([&initial](auto* storage) {
+            using P = std::remove_pointer_t<decltype(storage)>;
+            size_t capacity = (initial.size() + initial.size() / 4) * sizeof(P);
+            if (!snapshot_writer.Open(snapshot_channel, std::max(snapshot_slots, 2), capacity))
+                std::cerr << "Cannot create the snapshot channel " << snapshot_channel << std::endl;
+        });
+    } else {
+        snapshot_writer.Close();
+    }
+}
+
+ThreadPool& SolverPool() {
+    int threads = solver_threads > 0 ? solver_threads : ThreadPool::AvailableCores();
+    if (!pool || pool->Size() != threads || pool_pinned != pin_threads) {
+        pool.reset();
+        pool = std::make_unique<ThreadPool>(threads, pin_threads);
+        pool_pinned = pin_threads;
+    }
+    return *pool;
+}
+
+Arena& StepArena() {
+    return step_arena;
+}
+
+Arena& WorkerArena() {
+    return *worker_arenas[ThreadPool::WorkerIndex()];
+}
+
+void ResetArenas() {
+    step_arena.Reset();
+    for (auto& arena: worker_arenas)
+        arena->Reset();
+    step_count++;
+}
+
+glm::ivec3 GridOrigin() {
+    return grid_origin;
+}
+
+glm::ivec3 GridSize() {
+    return grid_size;
+}
+
+uint32_t CellIndex(int x, int y, int z) {
+    if (layout_in_use == GRID_TILED)
+        return tiled_layout.Index(x, y, z);
+    return linear_layout.Index(x, y, z);
+}
+
+Cell GetCell(int x, int y, int z) {
+    // Under grid_levels only the blocks gathering from `grid` have their
+    // cells there, the others read the coarse cell holding them, whose mass
+    // spreads over scale^3 cells
+    if (levels_in_use && !block_level.empty() &&
+        !(block_level[BlockIndex(glm::uvec3(x, y, z) / (uint32_t)block_size)] & LEVEL_FINE_GATHER)) {
+        glm::uvec3 c = glm::uvec3(x, y, z) / (uint32_t)CoarseLevel::scale + (uint32_t)CoarseLevel::pad;
+        uint32_t index = layout_in_use == GRID_TILED ? coarse_tiled_layout.Index(c) : coarse_linear_layout.Index(c);
+        const float cells = CoarseLevel::scale * CoarseLevel::scale * CoarseLevel::scale;
+        return {coarse_grid.vel[index], coarse_grid.mass[index] / cells};
+    }
+    // With fused transfers `grid` already holds the next step's scatter
+    const Grid& updated = fused_in_use ? back_grid : grid;
+    uint32_t index = CellIndex(x, y, z);
+    return {updated.vel[index], updated.mass[index]};
+}
+
+// Merges b into a, keeping their total mass, momentum and volume
+static void Merge(Particle& a, const Particle& b) {
+    float mass = a.mass + b.mass;
+    float wa = a.mass / mass, wb = b.mass / mass;
+    a.pos = wa * a.pos + wb * b.pos;
+    a.vel = wa * a.vel + wb * b.vel;
+    a.C = wa * a.C + wb * b.C;
+    a.J = wa * a.J + wb * b.J;
+    a.mass = mass;
+}
+
+// Halves p into itself and the returned particle, moved apart along
+// `offset`. Their velocities follow C (zero without APIC) over the
+// offset, which keeps the momentum.
+static Particle Split(Particle& p, const glm::vec3& offset, const glm::vec3& lo, const glm::vec3& hi) {
+    Particle q = p;
+    glm::vec3 dv = p.C * offset;
+    p.mass = q.mass = 0.5f * p.mass;
+    p.pos = glm::clamp(p.pos + offset, lo, hi);
+    q.pos = glm::clamp(q.pos - offset, lo, hi);
+    p.vel += dv;
+    q.vel -= dv;
+    return q;
+}
+
+// Merges each particle of an overfull cell with its nearest neighbour
+// further in the list, in rounds, until the cell is down to
+// max_particles_per_cell. Returns the new count.
+static uint32_t MergeCell(Particle* cell, uint32_t n) {
+    uint32_t k = 0;
+    while (n > (uint32_t)max_per_cell_in_use) {
+        if (k + 1 >= n)
+            k = 0;
+        uint32_t nearest = k + 1;
+        glm::vec3 d = cell[nearest].pos - cell[k].pos;
+        float best = glm::dot(d, d);
+        for (uint32_t j = k + 2; j < n; ++j) {
+            d = cell[j].pos - cell[k].pos;
+            if (glm::dot(d, d) < best) {
+                best = glm::dot(d, d);
+                nearest = j;
+            }
+        }
+        Merge(cell[k], cell[nearest]);
+        cell[nearest] = cell[--n];
+        k++;
+    }
+    return n;
+}
+
+// Splits the heaviest particle of an underfull cell, while there is one of
+// at least twice particle_mass, until the cell holds min_particles_per_cell.
+// `cell` has room for them. Returns the new count.
+static uint32_t SplitCell(Particle* cell, uint32_t n, const glm::vec3& lo, const glm::vec3& hi) {
+    // Along alternating diagonals, a quarter of a cell apart
+    const float step = 0.125f / std::sqrt(3.0f);
+    const glm::vec3 offsets[4] = {
+        glm::vec3( 1,  1,  1) * step, glm::vec3(-1,  1, -1) * step,
+        glm::vec3( 1, -1, -1) * step, glm::vec3(-1, -1,  1) * step,
+    };
+    while (n < (uint32_t)min_per_cell_in_use) {
+        uint32_t heaviest = 0;
+        for (uint32_t k = 1; k < n; ++k)
+            if (cell[k].mass > cell[heaviest].mass)
+                heaviest = k;
+        if (cell[heaviest].mass < 2.0f * particle_mass)
+            break;
+        cell[n] = Split(cell[heaviest], offsets[n % 4], lo, hi);
+        n++;
+    }
+    return n;
+}
+
+// Rebuilds the stored particles cell by cell, merging and splitting them as
+// resample_particles describes
+template <typename P>
+static void ResampleParticles() {
+    auto& stored = ParticleStorage<P>();
+    // Under grid_levels the particles of the coarse blocks go by cell of the
+    // coarse level, numbered after the grid's cells
+    const bool levels = levels_in_use && !block_level.empty();
+    const glm::ivec3 coarse = (grid_size + CoarseLevel::scale - 1) / CoarseLevel::scale;
+    const uint32_t fine_cells = grid_size.x * grid_size.y * grid_size.z;
+    const uint32_t cells = fine_cells + (levels ? coarse.x * coarse.y * coarse.z : 0);
+    auto cell_of = [&](const glm::vec3& pos) {
+        glm::uvec3 c = glm::uvec3(pos);
+        if (levels && !(block_level[BlockIndex(c / (uint32_t)block_size)] & LEVEL_FINE_GATHER)) {
+            c /= (uint32_t)CoarseLevel::scale;
+            return fine_cells + c.x + (c.y + c.z * coarse.y) * coarse.x;
+        }
+        return c.x + (c.y + c.z * grid_size.y) * grid_size.x;
+    };
+
+    // Particle indices sorted by cell. A particle is never lighter than
+    // particle_mass, which bounds how many particles splits can make.
+    Span<uint32_t> offsets = step_arena.Allocate<uint32_t>(cells + 1, 0);
+    size_t capacity = 0;
+    for (const P& p: stored) {
+        offsets[cell_of(p.pos) + 1]++;
+        capacity += (size_t)(p.mass / particle_mass);
+    }
+    for (uint32_t c = 0; c < cells; ++c)
+        offsets[c + 1] += offsets[c];
+    Span<uint32_t> fill = step_arena.Allocate<uint32_t>(cells);
+    std::copy(offsets.begin(), offsets.end() - 1, fill.begin());
+    Span<uint32_t> order = step_arena.Allocate<uint32_t>(stored.size());
+    for (uint32_t i = 0; i < stored.size(); ++i)
+        order[fill[cell_of(stored[i].pos)]++] = i;
+
+    const float reach = kernel_order_in_use == KERNEL_CUBIC ? 2.0f : 1.0f;
+    const glm::vec3 lo = glm::vec3(reach), hi = glm::vec3(grid_size) - 1.0f - reach;
+    Span<Particle> resampled = step_arena.Allocate<Particle>(std::max(capacity, stored.size()));
+    uint32_t count = 0;
+    for (uint32_t c = 0; c < cells; ++c) {
+        uint32_t n = offsets[c + 1] - offsets[c];
+        if (n == 0)
+            continue;
+        Particle* cell = &resampled[count];
+        for (uint32_t k = 0; k < n; ++k)
+            cell[k] = Unpack(stored[order[offsets[c] + k]]);
+        if (n > (uint32_t)max_per_cell_in_use)
+            n = MergeCell(cell, n);
+        else if (n < (uint32_t)min_per_cell_in_use)
+            n = SplitCell(cell, n, lo, hi);
+        count += n;
+    }
+
+    stored.resize(count);
+    for (uint32_t i = 0; i < count; ++i)
+        Pack(stored[i], resampled[i]);
+}
+
+template <typename P>
+static constexpr SnapshotLayout LayoutOf() {
+    if constexpr (std::is_same_v<P, VelocityParticle>)
+        return SNAPSHOT_VELOCITY_PARTICLE;
+    else if constexpr (std::is_same_v<P, CompactParticle<Half, false>>)
+        return SNAPSHOT_COMPACT_FP16;
+    else if constexpr (std::is_same_v<P, CompactParticle<Half, true>>)
+        return SNAPSHOT_COMPACT_FP16_PACKED;
+    else if constexpr (std::is_same_v<P, CompactParticle<BFloat16, false>>)
+        return SNAPSHOT_COMPACT_BF16;
+    else if constexpr (std::is_same_v<P, CompactParticle<BFloat16, true>>)
+        return SNAPSHOT_COMPACT_BF16_PACKED;
+    else
+        return SNAPSHOT_PARTICLE;
+}
+
+// Copies the stored particles into the next slot of the snapshot channel,
+// spread over the pool. Steps with more particles than a slot holds are
+// skipped, reported once.
+template <typename P>
+static void PublishSnapshot() {
+    const auto& stored = ParticleStorage<P>();
+    if (stored.size() * sizeof(P) > snapshot_writer.Capacity()) {
+        if (!snapshot_overflowed)
+            std::cerr << "Snapshot channel " << snapshot_channel << " holds " << snapshot_writer.Capacity() / sizeof(P)
+                      << " particles, not publishing the steps with more (" << stored.size() << " at step "
+                      << step_count << ")" << std::endl;
+        snapshot_overflowed = true;
+        return;
+    }
+    char* data = (char*)snapshot_writer.Begin(step_count, stored.size(), LayoutOf<P>(), sizeof(P), &grid_origin.x);
+    pool->ParallelFor(0, stored.size(), 16384, [&stored, data](uint32_t first, uint32_t last) {
+        std::memcpy(data + (size_t)first * sizeof(P), &stored[first], (size_t)(last - first) * sizeof(P));
+    });
+    snapshot_writer.End();
+}
+
+// Fits the grid window to the particles' bounding box plus window_margin,
+// as far as the domain allows, once the box gets out of the window or the
+// window has grown well past it. The fitted window keeps a block of slack on
+// each side so that it is not refitted every step. Moving the origin shifts
+// the stored positions the other way, by whole cells. Returns whether the
+// window changed.
+template <typename P>
+static bool FitWindow() {
+    auto& stored = ParticleStorage<P>();
+    if (stored.empty())
+        return false;
+    glm::vec3 lo = stored[0].pos, hi = stored[0].pos;
+    for (const P& p: stored) {
+        lo = glm::min(lo, p.pos);
+        hi = glm::max(hi, p.pos);
+    }
+
+    // Cells the particles need, in domain coordinates
+    glm::ivec3 need_lo = glm::max(grid_origin + glm::ivec3(glm::floor(lo)) - window_margin, glm::ivec3(0));
+    glm::ivec3 need_hi = glm::min(grid_origin + glm::ivec3(glm::floor(hi)) + 1 + window_margin, domain_in_use);
+    glm::ivec3 need = need_hi - need_lo;
+    bool inside = glm::all(glm::greaterThanEqual(need_lo, grid_origin)) &&
+                  glm::all(glm::lessThanEqual(need_hi, grid_origin + grid_size));
+    bool loose = glm::any(glm::greaterThan(grid_size, need + 4 * block_size));
+    if (inside && !loose)
+        return false;
+
+    glm::ivec3 size = glm::min((need + 3 * block_size - 1) / block_size * block_size, domain_in_use);
+    glm::ivec3 origin = glm::clamp((need_lo + need_hi - size) / 2, glm::ivec3(0), domain_in_use - size);
+    if (origin == grid_origin && size == grid_size)
+        return false;
+
+    glm::vec3 shift = glm::vec3(origin - grid_origin);
+    grid_origin = origin;
+    SolverPool().ParallelFor(0, stored.size(), 4096, [&stored, shift](uint32_t first, uint32_t last) {
+        for (uint32_t i = first; i < last; ++i)
+            stored[i].pos -= shift;
+    });
+    if (size != grid_size) {
+        grid_size = size;
+        AssignGrid(SolverPool());
+    }
+    return true;
+}
+
+void Simulate() {
+    ResetArenas();
+    if (window_in_use) {
+        bool moved = false;
+        WithParticleStorage([&moved](auto* storage) {
+            moved = FitWindow<std::remove_pointer_t<decltype(storage)>>();
+        });
+        // The grid of the fused transfers, the sleeping tiles and the
+        // levels of the blocks are in the old window
+        if (moved) {
+            fused_primed = false;
+            WakeBlocks();
+            block_level.clear();
+        }
+    }
+    if (resample_in_use && step_count % resample_interval_in_use == 0) {
+        WithParticleStorage([](auto* storage) {
+            ResampleParticles<std::remove_pointer_t<decltype(storage)>>();
+        });
+        // The fused transfers scattered the particles as they were, the
+        // sleeping blocks cached them
+        fused_primed = false;
+        WakeBlocks();
+    }
+    step_kernel();
+    if (snapshot_writer.IsOpen()) {
+        WithParticleStorage([](auto* storage) {
+            PublishSnapshot<std::remove_pointer_t<decltype(storage)>>();
+        });
+    }
+}
+
+int PressureIterations() {
+    return pressure_iterations;
+}
+
+void WakeBlocks() {
+    for (BlockRest& rest: block_rest)
+        rest = {};
+}
+
+int FineBlocks() {
+    return fine_blocks;
+}
+
+size_t SleepingParticles() {
+    size_t count = 0;
+    for (const BlockRest& rest: block_rest)
+        if (rest.state != BlockRest::AWAKE)
+            count += rest.particles;
+    return count;
+}
+
+void SyncParticles() {
+    WithParticleStorage([](auto* storage) {
+        using P = std::remove_pointer_t<decltype(storage)>;
+        if constexpr (!std::is_same_v<P, Particle>) {
+            const auto& stored = ParticleStorage<P>();
+            particles.resize(stored.size());
+            SolverPool().ParallelFor(0, stored.size(), 4096, [&stored](uint32_t first, uint32_t last) {
+                for (uint32_t i = first; i < last; ++i)
+                    particles[i] = Unpack(stored[i]);
+            });
+        }
+    });
+}
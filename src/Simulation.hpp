@@ -0,0 +1,362 @@
+#pragma once
+
+#include "Arena.hpp"
+#include "GridLayout.hpp"
+#include "Half.hpp"
+#include "PageAllocator.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/ext/vector_int3_sized.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+struct Particle {
+    glm::vec3 pos;
+    glm::vec3 vel;
+    glm::mat3 C;
+    float J; // Volume ratio to the rest volume, tracked by FLUID_VOLUME_RATIO
+    float mass; // particle_mass until resampling merges or splits the particle
+};
+
+// The viewer's shaders (cull.comp, culled.vert) mirror it
+static_assert(sizeof(Particle) == 68);
+
+// Particle as the solver stores it under a reduced affine_precision, 44
+// bytes with the velocity packed too and 52 without, instead of 68. The
+// kernels unpack it to a Particle, `particles` is only refreshed by
+// SyncParticles().
+template <typename Scalar, bool PackedVelocity>
+struct CompactParticle {
+    glm::vec3 pos;
+    float J;
+    float mass; // Before the 2-byte aligned members, which would pad it
+    std::conditional_t<PackedVelocity, PackedVec3<Scalar>, glm::vec3> vel;
+    PackedMat3<Scalar> C;
+};
+
+static_assert(sizeof(CompactParticle<Half, true>) == 44 && sizeof(CompactParticle<Half, false>) == 52);
+
+// Particle as the solver stores it under TRANSFER_PIC and TRANSFER_FLIP,
+// which have no affine matrix: 32 bytes
+struct VelocityParticle {
+    glm::vec3 pos;
+    float J;
+    glm::vec3 vel;
+    float mass;
+};
+
+// Grid as separate planes, so a pass only streams the quantities it reads:
+// 4 bytes per cell for the density gather, 12 for G2P (6 from half_vel).
+struct Grid {
+    PageVector<float> mass;
+    PageVector<glm::vec3> vel;
+    PageVector<PackedVec3<Half>> half_vel; // Updated velocity for G2P, if half_grid_velocity
+    // TRANSFER_FLIP: stress momentum scattered apart from `vel`, and the
+    // velocity before the update
+    PageVector<glm::vec3> stress;
+    PageVector<glm::vec3> old_vel;
+
+    // Reallocate to `size` zeroed cells, first touched by the pool's workers
+    void Assign(size_t size, ThreadPool& pool, bool half_velocity = false, bool flip = false) {
+        FirstTouch(pool, mass, size, 0.0f);
+        FirstTouch(pool, vel, size, glm::vec3(0.0f));
+        FirstTouch(pool, half_vel, half_velocity ? size : 0, PackedVec3<Half>(glm::vec3(0.0f)));
+        FirstTouch(pool, stress, flip ? size : 0, glm::vec3(0.0f));
+        FirstTouch(pool, old_vel, flip ? size : 0, glm::vec3(0.0f));
+    }
+};
+
+// Grid planes in 64-bit fixed point, used to accumulate P2G when it has to
+// be deterministic: integer adds are associative, so the sums no longer
+// depend on which thread merges first.
+struct FixedGrid {
+    static constexpr double scale = 4294967296.0; // 2^32, i.e. ~2.3e-10 resolution
+
+    PageVector<int64_t> mass;
+    PageVector<glm::i64vec3> vel;
+    PageVector<glm::i64vec3> stress; // TRANSFER_FLIP only, as in Grid
+
+    void Assign(size_t size, ThreadPool& pool, bool flip = false) {
+        FirstTouch(pool, mass, size, (int64_t)0);
+        FirstTouch(pool, vel, size, glm::i64vec3(0));
+        FirstTouch(pool, stress, flip ? size : 0, glm::i64vec3(0));
+    }
+
+    static int64_t ToFixed(float value) {
+        return std::llrint((double)value * scale);
+    }
+
+    static float ToFloat(int64_t value) {
+        return (float)((double)value / scale);
+    }
+};
+
+// One cell read out of the grid planes
+struct Cell {
+    glm::vec3 vel;
+    float mass;
+};
+
+enum GridLayout {
+    GRID_LINEAR,
+    GRID_TILED
+};
+
+enum P2GMode {
+    P2G_SCATTER, // Every particle adds straight into the grid, single threaded
+    P2G_TILES    // Particles binned per block, each thread scatters into a
+                 // private block + halo tile that is then merged into the grid
+};
+
+enum FluidModel {
+    FLUID_GATHER,      // Density gathered from the grid mass, P2G in two passes
+    FLUID_VOLUME_RATIO // Density from the per-particle volume ratio J, a single
+                       // P2G pass scattering mass, momentum and stress together
+};
+
+enum TransferScheme {
+    TRANSFER_APIC, // Affine particle velocities, C carried by every particle
+    TRANSFER_PIC,  // Particle velocity gathered from the grid, dissipative
+    TRANSFER_FLIP  // Grid velocity change added to the particle's velocity,
+                   // blended with PIC by flip_blend
+};
+
+enum KernelOrder {
+    KERNEL_LINEAR,    // 2^3 stencil, for previews
+    KERNEL_QUADRATIC, // 3^3
+    KERNEL_CUBIC      // 4^3, smoother
+};
+
+enum PressureSolver {
+    PRESSURE_EXPLICIT, // Stress of the current density scattered by P2G
+    PRESSURE_IMPLICIT  // Plus a backward Euler pressure correction solved
+                       // on the grid, stable at larger dt
+};
+
+enum Precision {
+    PRECISION_FP32,
+    PRECISION_FP16, // Half
+    PRECISION_BF16  // BFloat16
+};
+
+enum SimdLevel {
+    SIMD_AUTO,    // Widest the CPU supports
+    SIMD_GENERIC, // Baseline of the compiler flags
+    SIMD_SSE42,
+    SIMD_AVX2,    // AVX2 + FMA
+    SIMD_AVX512   // AVX-512 F/VL/BW/DQ
+};
+
+// Time step. Under PRESSURE_EXPLICIT the largest stable one shrinks as
+// eos_stiffness grows, the default being about the limit at the default
+// stiffness. PRESSURE_IMPLICIT lifts that limit, not the one of particles
+// crossing about a cell per step.
+extern float dt;
+
+const float gravity = -0.3f;
+const float particle_mass = 1.0f;
+
+const float rest_density = 6.0f;
+
+// Scales the pressure of the equation of state. Raising it makes the fluid
+// less compressible and lowers the largest stable explicit dt.
+extern float eos_stiffness;
+const float eos_power = 4;
+
+const float damping = 0.999f;
+
+// Bounds of the volume ratio J under FLUID_VOLUME_RATIO
+const float min_J = 0.6f;
+const float max_J = 1.2f;
+
+const int particle_res = 16;
+// Cells along each side of the grid, and of the domain by default
+const int grid_res = 45;
+
+// Active cells are tracked per block, a block is one brick of the tiled layout
+const int block_size = TiledLayout::brick;
+
+extern PageVector<Particle> particles;
+extern Grid grid;
+
+// Selects the cell ordering of `grid`, takes effect on the next Init()
+extern GridLayout grid_layout;
+extern LinearLayout linear_layout;
+extern TiledLayout tiled_layout;
+
+// Cells of the box the walls enclose. Without moving_window the grid
+// covers all of it. With moving_window the grid is a window of the domain
+// fitted to the particles' bounding box plus window_margin cells: it
+// slides along with the fluid and is resized as the fluid spreads or
+// gathers, so the grid's memory follows the fluid's extent and the domain
+// may be far larger. Particle positions and cell coordinates are relative
+// to GridOrigin(), the window's corner in the domain. Take effect on the
+// next Init().
+extern glm::ivec3 domain_size;
+extern bool moving_window;
+extern int window_margin;
+
+glm::ivec3 GridOrigin();
+// Cells of the grid window along each axis
+glm::ivec3 GridSize();
+
+extern P2GMode p2g_mode;
+
+// Switching it mid-run keeps the J of the particles, which FLUID_GATHER does
+// not update; call Init() after switching to FLUID_VOLUME_RATIO. Under
+// TRANSFER_FLIP the solver gathers the density whatever the model.
+extern FluidModel fluid_model;
+
+// Fuse G2P of a step with P2G of the next one into a single particle sweep,
+// ping-ponging between two grids. Only applies to FLUID_VOLUME_RATIO with
+// P2G_SCATTER, the others need the whole grid mass or the particle bins
+// before scattering. Takes effect on the next Init().
+extern bool fused_transfers;
+
+// Run P2G_TILES steps as a task graph of bins and blocks on a work-stealing
+// pool rather than as phases separated by barriers. Not applied with
+// deterministic_p2g, whose fixed point sums are resolved per phase.
+extern bool task_graph;
+
+// Accumulate P2G_TILES in fixed point, so threaded runs are bit identical
+// to single threaded ones. Takes effect on the next Init().
+extern bool deterministic_p2g;
+
+// Particle to grid transfers, and the FLIP share of the FLIP/PIC blend.
+// TRANSFER_PIC and TRANSFER_FLIP store particles without C (and ignore
+// affine_precision and packed_velocity), call SyncParticles() before
+// reading `particles`. Take effect on the next Init().
+extern TransferScheme transfer_scheme;
+extern float flip_blend;
+
+// Order of the B-spline interpolating between particles and grid, a
+// template parameter of the transfer kernels. The linear and cubic kernels
+// are only built for fp32 particles and ignore affine_precision and
+// packed_velocity. Takes effect on the next Init().
+extern KernelOrder kernel_order;
+
+// How the pressure enters the grid update. PRESSURE_IMPLICIT solves for
+// the grid velocity by conjugate gradients over the active cells, until
+// the residual drops below pressure_tolerance of the right hand side or
+// after pressure_max_iterations. Not run as a task graph. Takes effect on
+// the next Init().
+extern PressureSolver pressure_solver;
+extern int pressure_max_iterations;
+extern float pressure_tolerance;
+
+// CG iterations of the last step, 0 under PRESSURE_EXPLICIT
+int PressureIterations();
+
+// Every resample_interval steps, merge the particles of cells holding more
+// than max_particles_per_cell pairwise with their nearest neighbour, and
+// split merged particles back in two where a cell holds fewer than
+// min_particles_per_cell. Mass, momentum and volume are conserved; no
+// particle gets lighter than particle_mass, so the count never exceeds
+// the initial one. The particles come out sorted by cell, and
+// `particles` changes size: read particles.size() after SyncParticles().
+// Takes effect on the next Init(), which raises max_particles_per_cell to
+// at least 1 and clamps min_particles_per_cell to [0, max].
+extern bool resample_particles;
+extern int resample_interval;
+extern int min_particles_per_cell;
+extern int max_particles_per_cell;
+
+// Let P2G_TILES skip the blocks at rest. A block whose cells stay under
+// sleep_velocity (RMS, by mass), their mass changing by less than
+// sleep_mass_change of it per step, for sleep_steps steps in a row falls
+// asleep: its particles freeze and their P2G contribution is cached. It
+// wakes when particles enter it or the grid velocity over it, which its
+// neighbours scatter into, exceeds wake_velocity. Not applied with PRESSURE_IMPLICIT or fused
+// transfers, and P2G_TILES steps then skip the task graph. Takes effect on
+// the next Init().
+extern bool sleeping_blocks;
+extern float sleep_velocity;
+extern float wake_velocity;
+extern float sleep_mass_change;
+extern int sleep_steps;
+
+// Wakes every block, for changes the solver cannot see such as particles
+// or forces edited from outside
+void WakeBlocks();
+// Particles of the sleeping blocks
+size_t SleepingParticles();
+
+// With grid_levels = 2, only the blocks with detail keep the grid's
+// resolution: occupied blocks next to an empty one (the free surface) or
+// holding a particle faster than refine_velocity. The rest of the fluid
+// goes through a coarse grid of twice the cell size. Each level also gets
+// the particles next to its blocks, which couple the two. Under
+// fine_block_budget (0 for none) the fastest blocks stay fine first, the
+// budget counting the fine blocks with their surroundings. With
+// resample_particles, coarse cells are resampled like the grid's cells, so
+// the calm fluid also holds fewer particles. Only applies to P2G_SCATTER
+// with PRESSURE_EXPLICIT, without fused transfers. Take effect on the next
+// Init().
+extern int grid_levels;
+extern float refine_velocity;
+extern int fine_block_budget;
+
+// Blocks at the grid's resolution in the last step, 0 without grid_levels
+int FineBlocks();
+
+// Name of a POSIX shared memory object ("/mls-mpm") that Simulate()
+// publishes the particles into after every step, for other processes to
+// read; empty for none. It keeps the last snapshot_slots steps, in the
+// solver's storage format, see SnapshotChannel.hpp. A slot holds a
+// quarter more particles than Init() made, steps past that are skipped and
+// reported. Not applied to distributed runs. Take effect on the next Init().
+extern std::string snapshot_channel;
+extern int snapshot_slots;
+
+// Storage precision of the particles' affine matrix C, and of their
+// velocity too with packed_velocity. The solver then keeps its particles
+// in CompactParticle form, call SyncParticles() before reading `particles`.
+// half_grid_velocity has G2P read the updated grid velocity from fp16
+// copies. The math stays fp32 either way. Take effect on the next Init().
+extern Precision affine_precision;
+extern bool packed_velocity;
+extern bool half_grid_velocity;
+
+// Instruction set of the step kernels, which are built for each of them
+// and picked at run time. A level the CPU lacks falls back to the widest
+// supported one. Takes effect on the next Init().
+extern SimdLevel simd_level;
+
+// Level picked by the last Init(), and its name
+SimdLevel SimdLevelInUse();
+const char* SimdLevelName(SimdLevel level);
+
+// Workers of the solver's pool, 0 for one per available core, and whether
+// to pin them to their core. Take effect on the next Init() or SolverPool(),
+// which only then replace the pool.
+extern int solver_threads;
+extern bool pin_threads;
+
+// The pool every parallel part of the solver runs on, to be shared by the
+// rest of the program rather than spawning more threads
+ThreadPool& SolverPool();
+
+// Scratch memory for the temporaries of a step, valid until the next
+// Simulate(): one arena shared by the step, and one per pool worker for
+// the calling worker (each to be used by one thread only)
+Arena& StepArena();
+Arena& WorkerArena();
+
+void Init(unsigned int seed = std::random_device()());
+void Simulate();
+
+// Unpacks the solver's particles into `particles`, nothing to do with APIC
+// at PRECISION_FP32 where the solver steps `particles` itself
+void SyncParticles();
+
+// Index of cell (x, y, z) in `grid` for the current layout
+uint32_t CellIndex(int x, int y, int z);
+// Cell (x, y, z) of the grid after the last step, read from the coarse
+// level for the blocks that grid_levels coarsened
+Cell GetCell(int x, int y, int z);
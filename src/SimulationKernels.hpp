@@ -0,0 +1,1483 @@
+// Kernels of a step, compiled once per instruction set: included by the
+// Simulation_<isa>.cpp files after SimulationState.hpp and their target
+// pragma, with KERNEL_ISA naming the namespace the build lands in. No
+// include guard on purpose. Every header is included by SimulationState.hpp
+// ahead of the pragma and keeps the baseline target, so whichever copy of
+// their inline functions the linker keeps runs on any CPU.
+
+#ifndef KERNEL_ISA
+#error "define KERNEL_ISA before including SimulationKernels.hpp"
+#endif
+
+namespace KERNEL_ISA {
+
+// What the P2G_TILES kernels accumulate into: the float grid directly, or
+// the fixed point planes that are then resolved into it
+struct FloatAccumulator {
+    using Mass = float;
+    using Vel = glm::vec3;
+
+    static Grid& Target() { return grid; }
+    static Mass ToMass(float mass) { return mass; }
+    static Vel ToVel(const glm::vec3& vel) { return vel; }
+};
+
+struct FixedAccumulator {
+    using Mass = int64_t;
+    using Vel = glm::i64vec3;
+
+    static FixedGrid& Target() { return fixed_grid; }
+    static Mass ToMass(float mass) { return FixedGrid::ToFixed(mass); }
+    static Vel ToVel(const glm::vec3& vel) {
+        return Vel(FixedGrid::ToFixed(vel.x), FixedGrid::ToFixed(vel.y), FixedGrid::ToFixed(vel.z));
+    }
+};
+
+// B-spline interpolation kernels, the template parameter giving the
+// stencil of the transfers: Width^3 cells from `base`, the weights, the D^-1
+// factor of the affine and stress terms, and how many cells past its own
+// the stencil of a particle reaches.
+struct LinearBSpline {
+    static const int width = 2;
+    static const int reach = 1;
+    // D depends on the position within the cell with linear weights, this is
+    // its inverse midway between two nodes. Preview quality.
+    static constexpr float inverse_D = 4.0f;
+
+    static void Weights(const glm::vec3& pos, glm::uvec3& base, glm::vec3* weights) {
+        glm::vec3 node_pos = pos - 0.5f;
+        base = glm::uvec3(node_pos);
+        glm::vec3 f = node_pos - glm::vec3(base);
+        weights[0] = 1.0f - f;
+        weights[1] = f;
+    }
+};
+
+struct QuadraticBSpline {
+    static const int width = 3;
+    static const int reach = 1;
+    static constexpr float inverse_D = 4.0f;
+
+    static void Weights(const glm::vec3& pos, glm::uvec3& base, glm::vec3* weights) {
+        glm::uvec3 cell_idx = glm::uvec3(pos);
+        glm::vec3 cell_diff = (pos - glm::vec3(cell_idx)) - 0.5f;
+        base = cell_idx - 1u;
+        weights[0] = 0.5f  * glm::pow(0.5f - cell_diff, glm::vec3(2.0f));
+        weights[1] = 0.75f - glm::pow(cell_diff, glm::vec3(2.0f));
+        weights[2] = 0.5f  * glm::pow(0.5f + cell_diff, glm::vec3(2.0f));
+    }
+};
+
+struct CubicBSpline {
+    static const int width = 4;
+    static const int reach = 2;
+    static constexpr float inverse_D = 3.0f;
+
+    static void Weights(const glm::vec3& pos, glm::uvec3& base, glm::vec3* weights) {
+        glm::vec3 node_pos = pos - 0.5f;
+        glm::uvec3 node = glm::uvec3(node_pos);
+        glm::vec3 f = node_pos - glm::vec3(node);
+        glm::vec3 g = 1.0f - f;
+        base = node - 1u;
+        weights[0] = g * g * g / 6.0f;
+        weights[1] = 0.5f * f * f * f - f * f + 2.0f / 3.0f;
+        weights[2] = 0.5f * g * g * g - g * g + 2.0f / 3.0f;
+        weights[3] = f * f * f / 6.0f;
+    }
+};
+
+// Calls f((K*)nullptr) with K the kernel of kernel_order_in_use
+template <typename F>
+void WithKernel(F f) {
+    if (kernel_order_in_use == KERNEL_LINEAR)
+        f((LinearBSpline*)nullptr);
+    else if (kernel_order_in_use == KERNEL_CUBIC)
+        f((CubicBSpline*)nullptr);
+    else
+        f((QuadraticBSpline*)nullptr);
+}
+
+// Private accumulation buffer of one thread: a block plus the halo of cells
+// the stencils of the block's particles can reach
+template <typename AccumulatorType, typename Kernel>
+struct Tile {
+    using Accumulator = AccumulatorType;
+    static const int size = block_size + 2 * Kernel::reach;
+    static const int cells = size * size * size;
+
+    glm::uvec3 origin; // Grid coordinates of local cell (0, 0, 0)
+    typename Accumulator::Mass mass[cells];
+    typename Accumulator::Vel vel[cells];
+    typename Accumulator::Vel stress[cells]; // Only used with split_stress()
+
+    void Reset(uint32_t block, bool with_stress) {
+        origin = BlockCoords(block) * (uint32_t)block_size - (uint32_t)Kernel::reach;
+        std::fill(mass, mass + cells, typename Accumulator::Mass(0));
+        std::fill(vel, vel + cells, typename Accumulator::Vel(0));
+        if (with_stress)
+            std::fill(stress, stress + cells, typename Accumulator::Vel(0));
+    }
+
+    uint32_t Index(glm::uvec3 cell) const {
+        return IndexLocal(cell - origin);
+    }
+
+    static uint32_t IndexLocal(glm::uvec3 local) {
+        return local.x + local.y * size + local.z * size * size;
+    }
+};
+
+// One tile per worker for each tile type, handed out by AllocateTiles()
+template <typename Tile>
+Span<Tile*>& Tiles() {
+    static Span<Tile*> tiles;
+    return tiles;
+}
+
+// Gives every worker a tile from its own arena, so the worker touching it
+// first is the one using it, and the other threads' slots one each, as they
+// may steal a task while waiting on the pool. Once per step and tile type.
+template <typename Tile>
+void AllocateTiles() {
+    static uint64_t allocated_step = ~0ull;
+    if (allocated_step == step_count)
+        return;
+    allocated_step = step_count;
+
+    auto& tiles = Tiles<Tile>();
+    tiles = step_arena.Allocate<Tile*>(pool->Slots());
+    pool->ForEachWorker([&tiles](int worker) {
+        tiles[worker] = WorkerArena().Allocate<Tile>(1).data;
+    });
+    for (int slot = pool->Size(); slot < pool->Slots(); ++slot)
+        tiles[slot] = step_arena.Allocate<Tile>(1).data;
+}
+
+// Calls f(x, y, z, cell_index) for every cell of a block
+template <typename Layout, typename F>
+void ForEachBlockCell(const Layout& layout, uint32_t block, F f) {
+    glm::ivec3 b = glm::ivec3(BlockCoords(block));
+
+    int x0 = b.x * block_size, x1 = std::min(x0 + block_size, grid_size.x);
+    int y0 = b.y * block_size, y1 = std::min(y0 + block_size, grid_size.y);
+    int z0 = b.z * block_size, z1 = std::min(z0 + block_size, grid_size.z);
+    for (int z = z0; z < z1; ++z)
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x)
+                f(x, y, z, layout.Index(x, y, z));
+}
+
+// Calls f(x, y, z, cell_index) for every cell of an active block, the blocks
+// spread over the pool
+template <typename Layout, typename F>
+void ForEachActiveCell(const Layout& layout, F f) {
+    pool->ParallelFor(0, active_blocks.size(), 16, [&](uint32_t first, uint32_t last) {
+        for (uint32_t i = first; i < last; ++i)
+            ForEachBlockCell(layout, active_blocks[i], f);
+    });
+}
+
+// Flags the blocks a stencil around cell_idx can cover
+template <typename Kernel>
+void MarkActive(glm::uvec3 cell_idx) {
+    glm::uvec3 lo = (cell_idx - (uint32_t)Kernel::reach) / (uint32_t)block_size;
+    glm::uvec3 hi = (cell_idx + (uint32_t)Kernel::reach) / (uint32_t)block_size;
+    for (uint32_t bz = lo.z; bz <= hi.z; ++bz) {
+        for (uint32_t by = lo.y; by <= hi.y; ++by) {
+            for (uint32_t bx = lo.x; bx <= hi.x; ++bx) {
+                uint32_t block = BlockIndex(glm::uvec3(bx, by, bz));
+                if (!block_active[block]) {
+                    block_active[block] = 1;
+                    active_blocks.push_back(block);
+                }
+            }
+        }
+    }
+}
+
+// FLIP needs the grid velocity of the particle momentum alone, so P2G adds
+// the stress momentum into separate planes that the grid update adds in
+inline bool split_stress() {
+    return transfer_in_use == TRANSFER_FLIP;
+}
+
+// Whether this step lets blocks sleep, which goes by the bins of P2G_TILES
+inline bool sleeping() {
+    return sleep_in_use && p2g_mode == P2G_TILES;
+}
+
+template <typename Layout>
+void ClearGrid(const Layout& layout) {
+    // Only the blocks written last step can be non zero
+    ForEachActiveCell(layout, [](int, int, int, uint32_t cell_index) {
+        grid.vel[cell_index] = glm::vec3(0.0f);
+        grid.mass[cell_index] = 0.0f;
+        if (split_stress())
+            grid.stress[cell_index] = glm::vec3(0.0f);
+        if (deterministic_in_use) {
+            fixed_grid.vel[cell_index] = glm::i64vec3(0);
+            fixed_grid.mass[cell_index] = 0;
+            if (split_stress())
+                fixed_grid.stress[cell_index] = glm::i64vec3(0);
+        }
+    });
+    for (uint32_t block: active_blocks)
+        block_active[block] = 0;
+    active_blocks.clear();
+}
+
+// Kernel weights of the stencil around a particle, whose first cell is
+// `base`
+template <typename Kernel>
+struct Stencil {
+    glm::uvec3 base;
+    glm::vec3 weights[Kernel::width];
+
+    Stencil(const glm::vec3& pos) {
+        Kernel::Weights(pos, base, weights);
+    }
+
+    float Weight(uint32_t gx, uint32_t gy, uint32_t gz) const {
+        return weights[gx].x * weights[gy].y * weights[gz].z;
+    }
+};
+
+// Where the P2G kernels scatter: straight into the grid, or into a tile
+template <typename Layout, typename Kernel>
+struct GridSink {
+    const Layout& layout;
+    Grid& target;
+    uint32_t base_index;
+    const int32_t* stencil;
+
+    GridSink(const Layout& layout, Grid& target) : layout(layout), target(target) {}
+
+    void Begin(glm::uvec3 base) {
+        base_index = layout.Index(base);
+        stencil = layout.template Stencil<Kernel::width>(base);
+    }
+    uint32_t Index(uint32_t gx, uint32_t gy, uint32_t gz) const {
+        return base_index + stencil[(gx * Kernel::width + gy) * Kernel::width + gz];
+    }
+    void AddMass(uint32_t index, float mass) { target.mass[index] += mass; }
+    void AddVel(uint32_t index, const glm::vec3& vel) { target.vel[index] += vel; }
+    void AddStress(uint32_t index, const glm::vec3& momentum) { target.stress[index] += momentum; }
+};
+
+template <typename Accumulator, typename Kernel>
+struct TileSink {
+    using Tile = KERNEL_ISA::Tile<Accumulator, Kernel>;
+    Tile& tile;
+    uint32_t base_index;
+
+    TileSink(Tile& tile) : tile(tile) {}
+
+    void Begin(glm::uvec3 base) {
+        base_index = tile.Index(base);
+    }
+    uint32_t Index(uint32_t gx, uint32_t gy, uint32_t gz) const {
+        return base_index + Tile::IndexLocal(glm::uvec3(gx, gy, gz));
+    }
+    void AddMass(uint32_t index, float mass) { tile.mass[index] += Accumulator::ToMass(mass); }
+    void AddVel(uint32_t index, const glm::vec3& vel) { tile.vel[index] += Accumulator::ToVel(vel); }
+    void AddStress(uint32_t index, const glm::vec3& momentum) {
+        tile.stress[index] += Accumulator::ToVel(momentum);
+    }
+};
+
+// Mass and momentum of one particle, with C's affine part under APIC.
+// Distances are in cells of the Level, C works in cells of `grid`.
+template <typename Transfer, typename Kernel, typename Level = BaseLevel, typename Sink>
+void ScatterMass(const Particle& p, Sink& sink) {
+    glm::vec3 pos = Level::ToLevel(p.pos);
+    Stencil<Kernel> s(pos);
+    sink.Begin(s.base);
+
+    for (uint32_t gx = 0; gx < Kernel::width; ++gx) {
+        for (uint32_t gy = 0; gy < Kernel::width; ++gy) {
+            for (uint32_t gz = 0; gz < Kernel::width; ++gz) {
+                float weight = s.Weight(gx, gy, gz);
+
+                glm::uvec3 cell_pos = s.base + glm::uvec3(gx, gy, gz);
+                glm::vec3 cell_dist = (glm::vec3(cell_pos) - pos) + 0.5f;
+                glm::vec3 vel = p.vel;
+                if constexpr (Transfer::affine)
+                    vel = p.vel + p.C * (cell_dist * (float)Level::scale);
+
+                uint32_t cell_index = sink.Index(gx, gy, gz);
+
+                float mass_contrib = weight * p.mass;
+                sink.AddMass(cell_index, mass_contrib);
+                sink.AddVel(cell_index, mass_contrib * vel);
+            }
+        }
+    }
+}
+
+// Pressure from the equation of state, as a (negated) isotropic stress
+inline glm::mat3 FluidStress(float density) {
+    float pressure = std::max(-0.1f, eos_stiffness *
+                            (std::pow(density/rest_density, eos_power) - 1.0f));
+
+    glm::mat3 stress = glm::mat3(
+        -pressure, 0, 0,
+        0, -pressure, 0,
+        0, 0, -pressure
+    );
+    return stress;
+}
+
+// Gathers the particle density from the grid mass, then scatters the
+// momentum of its stress. The grid mass has to be complete.
+template <typename Transfer, typename Kernel, typename Level = BaseLevel, typename Layout, typename Sink>
+void ScatterStress(const Layout& layout, const Particle& p, Sink& sink) {
+    glm::vec3 pos = Level::ToLevel(p.pos);
+    Stencil<Kernel> s(pos);
+
+    uint32_t base_index = layout.Index(s.base);
+    const int32_t* stencil = layout.template Stencil<Kernel::width>(s.base);
+
+    float density = 0.0f;
+    for (uint32_t gx = 0; gx < Kernel::width; ++gx) {
+        for (uint32_t gy = 0; gy < Kernel::width; ++gy) {
+            for (uint32_t gz = 0; gz < Kernel::width; ++gz) {
+                float weight = s.Weight(gx, gy, gz);
+                uint32_t cell_index = base_index + stencil[(gx * Kernel::width + gy) * Kernel::width + gz];
+                density += grid.mass[cell_index] * weight;
+            }
+        }
+    }
+    density /= (float)(Level::scale * Level::scale * Level::scale);
+
+    float volume = p.mass / density;
+    glm::mat3 stress = FluidStress(density);
+
+    const float inverse_D = Kernel::inverse_D / Level::scale;
+    auto eq_16_term_0 = -volume * inverse_D * stress * dt;
+
+    sink.Begin(s.base);
+    for (uint32_t gx = 0; gx < Kernel::width; ++gx) {
+        for (uint32_t gy = 0; gy < Kernel::width; ++gy) {
+            for (uint32_t gz = 0; gz < Kernel::width; ++gz) {
+                float weight = s.Weight(gx, gy, gz);
+
+                glm::uvec3 cell_pos = s.base + glm::uvec3(gx, gy, gz);
+                glm::vec3 cell_dist = (glm::vec3(cell_pos) - pos) + 0.5f;
+
+                uint32_t cell_index = sink.Index(gx, gy, gz);
+
+                glm::vec3 momentum = (eq_16_term_0 * weight) * cell_dist;
+                if constexpr (Transfer::flip)
+                    sink.AddStress(cell_index, momentum);
+                else
+                    sink.AddVel(cell_index, momentum);
+            }
+        }
+    }
+}
+
+// FLUID_VOLUME_RATIO: the density comes from the particle's own volume ratio
+// J, so mass, momentum and stress go out in a single pass
+template <typename Transfer, typename Kernel, typename Level = BaseLevel, typename Sink>
+void ScatterFluid(const Particle& p, Sink& sink) {
+    glm::vec3 pos = Level::ToLevel(p.pos);
+    Stencil<Kernel> s(pos);
+
+    float density = rest_density / p.J;
+    float volume = p.mass / density;
+    glm::mat3 stress = FluidStress(density);
+
+    const float inverse_D = Kernel::inverse_D / Level::scale;
+    auto eq_16_term_0 = -volume * inverse_D * stress * dt;
+
+    sink.Begin(s.base);
+    for (uint32_t gx = 0; gx < Kernel::width; ++gx) {
+        for (uint32_t gy = 0; gy < Kernel::width; ++gy) {
+            for (uint32_t gz = 0; gz < Kernel::width; ++gz) {
+                float weight = s.Weight(gx, gy, gz);
+
+                glm::uvec3 cell_pos = s.base + glm::uvec3(gx, gy, gz);
+                glm::vec3 cell_dist = (glm::vec3(cell_pos) - pos) + 0.5f;
+                glm::vec3 vel = p.vel;
+                if constexpr (Transfer::affine)
+                    vel = p.vel + p.C * (cell_dist * (float)Level::scale);
+
+                uint32_t cell_index = sink.Index(gx, gy, gz);
+
+                float mass_contrib = weight * p.mass;
+                glm::vec3 momentum = (eq_16_term_0 * weight) * cell_dist;
+                sink.AddMass(cell_index, mass_contrib);
+                if constexpr (Transfer::flip) {
+                    sink.AddVel(cell_index, mass_contrib * vel);
+                    sink.AddStress(cell_index, momentum);
+                } else {
+                    sink.AddVel(cell_index, mass_contrib * vel + momentum);
+                }
+            }
+        }
+    }
+}
+
+// Counting sort of the particles by block, also flags the active blocks
+template <typename Kernel, typename P>
+void BinParticles() {
+    const auto& stored = ParticleStorage<P>();
+    uint32_t bins = BlockCount();
+    bin_offsets = step_arena.Allocate<uint32_t>(bins + 1, 0);
+    bin_particles = step_arena.Allocate<uint32_t>(stored.size());
+    particle_bin = step_arena.Allocate<uint32_t>(stored.size());
+    occupied_bins = step_arena.Allocate<uint32_t>(bins);
+
+    for (uint32_t i = 0; i < stored.size(); ++i) {
+        glm::uvec3 cell_idx = glm::uvec3(stored[i].pos);
+        MarkActive<Kernel>(cell_idx);
+
+        particle_bin[i] = BlockIndex(cell_idx / (uint32_t)block_size);
+        bin_offsets[particle_bin[i]]++;
+    }
+
+    // Counts to start offsets
+    occupied_bins.count = 0;
+    uint32_t start = 0;
+    for (uint32_t b = 0; b + 1 < bin_offsets.size(); ++b) {
+        uint32_t count = bin_offsets[b];
+        if (count > 0)
+            occupied_bins[occupied_bins.count++] = b;
+        bin_offsets[b] = start;
+        start += count;
+    }
+
+    // Filling moves every start to the end of its bin, i.e. the next start
+    for (uint32_t i = 0; i < stored.size(); ++i)
+        bin_particles[bin_offsets[particle_bin[i]]++] = i;
+    for (uint32_t b = bin_offsets.size() - 1; b > 0; --b)
+        bin_offsets[b] = bin_offsets[b - 1];
+    bin_offsets[0] = 0;
+}
+
+// Relaxed atomic `target += value`, a compare and swap loop for floats
+template <typename T>
+void AtomicAdd(T& target, T value) {
+    if constexpr (std::is_integral_v<T>) {
+        __atomic_fetch_add(&target, value, __ATOMIC_RELAXED);
+    } else {
+        T expected, desired;
+        __atomic_load(&target, &expected, __ATOMIC_RELAXED);
+        do {
+            desired = expected + value;
+        } while (!__atomic_compare_exchange(&target, &expected, &desired, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+}
+
+// Adds a tile into the grid. Neighbouring tiles overlap on their halo, so
+// the adds are atomic, that is only Tile::cells atomics for a whole bin.
+template <typename Layout, typename Tile>
+void FlushTile(const Layout& layout, const Tile& tile, bool with_mass, bool with_stress) {
+    using Accumulator = typename Tile::Accumulator;
+    auto& target = Accumulator::Target();
+    for (uint32_t lz = 0; lz < Tile::size; ++lz) {
+        for (uint32_t ly = 0; ly < Tile::size; ++ly) {
+            for (uint32_t lx = 0; lx < Tile::size; ++lx) {
+                glm::uvec3 cell = tile.origin + glm::uvec3(lx, ly, lz);
+                // Halo past the grid wraps around to huge unsigned values
+                if (cell.x >= (uint32_t)grid_size.x || cell.y >= (uint32_t)grid_size.y ||
+                    cell.z >= (uint32_t)grid_size.z)
+                    continue;
+
+                uint32_t local = Tile::IndexLocal(glm::uvec3(lx, ly, lz));
+                const auto& vel = tile.vel[local];
+                const typename Accumulator::Vel zero(0);
+                bool stress = with_stress && tile.stress[local] != zero;
+                if (tile.mass[local] == 0 && vel == zero && !stress)
+                    continue;
+
+                uint32_t cell_index = layout.Index(cell);
+                if (with_mass)
+                    AtomicAdd(target.mass[cell_index], tile.mass[local]);
+                AtomicAdd(target.vel[cell_index].x, vel.x);
+                AtomicAdd(target.vel[cell_index].y, vel.y);
+                AtomicAdd(target.vel[cell_index].z, vel.z);
+                if (stress) {
+                    AtomicAdd(target.stress[cell_index].x, tile.stress[local].x);
+                    AtomicAdd(target.stress[cell_index].y, tile.stress[local].y);
+                    AtomicAdd(target.stress[cell_index].z, tile.stress[local].z);
+                }
+            }
+        }
+    }
+}
+
+// Converts the fixed point sums of the active cells back into the grid
+template <typename Layout>
+void ResolveFixed(const Layout& layout, bool with_mass) {
+    ForEachActiveCell(layout, [with_mass](int, int, int, uint32_t cell_index) {
+        if (with_mass)
+            grid.mass[cell_index] = FixedGrid::ToFloat(fixed_grid.mass[cell_index]);
+        const glm::i64vec3& vel = fixed_grid.vel[cell_index];
+        grid.vel[cell_index] = glm::vec3(FixedGrid::ToFloat(vel.x),
+                                         FixedGrid::ToFloat(vel.y),
+                                         FixedGrid::ToFloat(vel.z));
+        if (split_stress()) {
+            const glm::i64vec3& stress = fixed_grid.stress[cell_index];
+            grid.stress[cell_index] = glm::vec3(FixedGrid::ToFloat(stress.x),
+                                                FixedGrid::ToFloat(stress.y),
+                                                FixedGrid::ToFloat(stress.z));
+        }
+    });
+}
+
+// Cached P2G contribution of every sleeping bin, by bin. Only the pages of
+// the bins that fell asleep get touched.
+template <typename Tile>
+PageVector<Tile>& SleepTiles() {
+    static PageVector<Tile> tiles;
+    if (tiles.size() != block_rest.size())
+        tiles = PageVector<Tile>(block_rest.size());
+    return tiles;
+}
+
+// Keeps the tile of a DROWSY bin: the mass pass whole, plus the stress of
+// the second pass under FLUID_GATHER
+template <typename Tile>
+void CacheTile(const Tile& tile, Tile& cache, bool with_mass) {
+    if (with_mass) {
+        cache = tile;
+        return;
+    }
+    for (int i = 0; i < Tile::cells; ++i) {
+        cache.vel[i] += tile.vel[i];
+        if (split_stress())
+            cache.stress[i] += tile.stress[i];
+    }
+}
+
+// Runs scatter(p, sink) for every particle, bin by bin, each thread into its
+// own tile that is merged into the grid after every bin. With sleeping()
+// the bins asleep flush their cached tile in the mass pass instead, and the
+// drowsy ones fill their cache.
+template <typename Kernel, typename P, typename Accumulator, typename Layout, typename Scatter>
+void ScatterTiles(const Layout& layout, bool with_mass, Scatter scatter) {
+    using Tile = KERNEL_ISA::Tile<Accumulator, Kernel>;
+    const auto& stored = ParticleStorage<P>();
+    AllocateTiles<Tile>();
+    bool sleep = sleeping();
+    Tile* cache = sleep ? SleepTiles<Tile>().data() : nullptr;
+    // One bin per chunk, stealing balances the uneven bins
+    pool->ParallelFor(0, occupied_bins.size(), 1, [&](uint32_t first, uint32_t last) {
+        for (uint32_t n = first; n < last; ++n) {
+            uint32_t bin = occupied_bins[n];
+            BlockRest::State state = sleep ? block_rest[bin].state : BlockRest::AWAKE;
+            if (state == BlockRest::ASLEEP) {
+                if (with_mass)
+                    FlushTile(layout, cache[bin], true, split_stress());
+                continue;
+            }
+
+            Tile& tile = *Tiles<Tile>()[ThreadPool::WorkerIndex()];
+            tile.Reset(bin, split_stress());
+
+            TileSink<Accumulator, Kernel> sink(tile);
+            for (uint32_t k = bin_offsets[bin]; k < bin_offsets[bin + 1]; ++k)
+                scatter(Unpack(stored[bin_particles[k]]), sink);
+
+            if (state == BlockRest::DROWSY)
+                CacheTile(tile, cache[bin], with_mass);
+            FlushTile(layout, tile, with_mass, split_stress());
+        }
+    });
+}
+
+// Runs one P2G pass as selected by p2g_mode. `with_mass` tells whether the
+// pass scatters mass; P2G_SCATTER flags the active blocks during that pass,
+// P2G_TILES has done it when binning.
+template <typename Kernel, typename P, typename Layout, typename Scatter>
+void ScatterParticles(const Layout& layout, bool with_mass, Scatter scatter) {
+    if (p2g_mode == P2G_TILES && deterministic_in_use) {
+        ScatterTiles<Kernel, P, FixedAccumulator>(layout, with_mass, scatter);
+        ResolveFixed(layout, with_mass);
+    } else if (p2g_mode == P2G_TILES) {
+        ScatterTiles<Kernel, P, FloatAccumulator>(layout, with_mass, scatter);
+    } else {
+        const auto& stored = ParticleStorage<P>();
+        GridSink<Layout, Kernel> sink(layout, grid);
+        for (uint32_t i = 0; i < stored.size(); i++) {
+            if (with_mass)
+                MarkActive<Kernel>(glm::uvec3(stored[i].pos));
+            scatter(Unpack(stored[i]), sink);
+        }
+    }
+}
+
+// Wakes the stopped bins particles have moved into, before they scatter
+inline void WakeArrivals() {
+    for (uint32_t bin: occupied_bins) {
+        BlockRest& rest = block_rest[bin];
+        if (rest.state != BlockRest::AWAKE && rest.particles != bin_offsets[bin + 1] - bin_offsets[bin])
+            rest = {};
+    }
+}
+
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void P2G(const Layout& layout) {
+    if (p2g_mode == P2G_TILES)
+        BinParticles<Kernel, P>();
+    if (sleeping())
+        WakeArrivals();
+
+    if (volume_ratio()) {
+        ScatterParticles<Kernel, P>(layout, true, [](const Particle& p, auto& sink) {
+            ScatterFluid<Transfer, Kernel>(p, sink);
+        });
+    } else {
+        // P2G_1
+        ScatterParticles<Kernel, P>(layout, true, [](const Particle& p, auto& sink) {
+            ScatterMass<Transfer, Kernel>(p, sink);
+        });
+        // The density gather reads the halo's mass
+        if (slab_exchange)
+            slab_exchange->exchange_mass();
+        // P2G_2
+        ScatterParticles<Kernel, P>(layout, false, [&layout](const Particle& p, auto& sink) {
+            ScatterStress<Transfer, Kernel>(layout, p, sink);
+        });
+    }
+}
+
+// Zeroes the velocity components going through the domain walls
+template <typename Level = BaseLevel>
+void ApplyWalls(int x, int y, int z, glm::vec3& vel) {
+    if constexpr (Level::scale == 1) {
+        glm::ivec3 cell = glm::ivec3(x, y, z) + grid_origin;
+        if (cell.x < 1 || cell.x > domain_in_use.x - 2) {vel.x = 0.0f;}
+        if (cell.y < 1 || cell.y > domain_in_use.y - 2) {vel.y = 0.0f;}
+        if (cell.z < 1 || cell.z > domain_in_use.z - 2) {vel.z = 0.0f;}
+    } else {
+        // Where the node sits in the domain, in cells of `grid`: the walls
+        // stop the nodes of cells 0 and domain - 1, whose centres are at
+        // 0.5 and domain - 0.5
+        glm::vec3 node = (glm::vec3(x, y, z) + 0.5f - (float)Level::pad) * (float)Level::scale +
+                         glm::vec3(grid_origin);
+        glm::vec3 hi = glm::vec3(domain_in_use) - 1.5f;
+        if (node.x < 1.5f || node.x > hi.x) {vel.x = 0.0f;}
+        if (node.y < 1.5f || node.y > hi.y) {vel.y = 0.0f;}
+        if (node.z < 1.5f || node.z > hi.z) {vel.z = 0.0f;}
+    }
+}
+
+template <typename Transfer, typename Level = BaseLevel>
+void UpdateCell(int x, int y, int z, uint32_t cell_index) {
+    float mass = grid.mass[cell_index];
+    glm::vec3& vel = grid.vel[cell_index];
+    if (mass > 0)
+        vel /= mass;
+    if constexpr (Transfer::flip) {
+        grid.old_vel[cell_index] = vel;
+        if (mass > 0)
+            vel += grid.stress[cell_index] / mass;
+    }
+    if (mass > 0) {
+        vel += dt * glm::vec3(0.0f, gravity, 0.0f);
+        ApplyWalls<Level>(x, y, z, vel);
+    }
+    // Every cell of the active blocks, which covers all G2P reads
+    if (half_grid_in_use)
+        grid.half_vel[cell_index] = vel;
+}
+
+template <typename Transfer, typename Level = BaseLevel, typename Layout>
+void GridUpdate(const Layout& layout) {
+    ForEachActiveCell(layout, UpdateCell<Transfer, Level>);
+}
+
+// Moves the occupied bins along their rest states from the RMS speed and the
+// mass of the updated grid over their block: AWAKE ones at rest for sleep_steps
+// steps stop as DROWSY, DROWSY ones have cached their tile and fall ASLEEP,
+// stopped ones the grid moves faster than wake_velocity wake up.
+template <typename Layout>
+void UpdateSleep(const Layout& layout) {
+    pool->ParallelFor(0, occupied_bins.size(), 16, [&](uint32_t first, uint32_t last) {
+        for (uint32_t n = first; n < last; ++n) {
+            uint32_t bin = occupied_bins[n];
+            // Mass weighted, as cells at the surface with little mass in them
+            // jitter at high speed
+            float energy = 0.0f, mass = 0.0f;
+            ForEachBlockCell(layout, bin, [&](int, int, int, uint32_t cell_index) {
+                energy += grid.mass[cell_index] * glm::dot(grid.vel[cell_index], grid.vel[cell_index]);
+                mass += grid.mass[cell_index];
+            });
+            float speed = mass > 0.0f ? std::sqrt(energy / mass) : 0.0f;
+
+            BlockRest& rest = block_rest[bin];
+            bool at_rest = speed < sleep_velocity &&
+                           std::abs(mass - rest.mass) <= sleep_mass_change * rest.mass;
+            rest.mass = mass;
+            if (rest.state == BlockRest::AWAKE) {
+                rest.rest_steps = at_rest ? std::min(rest.rest_steps + 1, 0xffff) : 0;
+                if (rest.rest_steps >= sleep_steps) {
+                    rest.state = BlockRest::DROWSY;
+                    rest.particles = bin_offsets[bin + 1] - bin_offsets[bin];
+                }
+                continue;
+            }
+            rest.state = BlockRest::ASLEEP;
+            if (speed > wake_velocity) {
+                rest.state = BlockRest::AWAKE;
+                rest.rest_steps = 0;
+            }
+        }
+    });
+    // Empty bins start over
+    for (uint32_t bin = 0; bin < block_rest.size(); ++bin)
+        if (bin_offsets[bin] == bin_offsets[bin + 1])
+            block_rest[bin] = {};
+}
+
+// PRESSURE_IMPLICIT: backward Euler on the pressure, linearized around the
+// current densities. With v* the velocity left by UpdateCell(), the updated
+// velocity v solves
+//     (M + dt^2 G^T K G) v = M v*
+// where G v gives the divergence at every particle (the trace of the C
+// that G2P would gather) and K is the particles' volume times their bulk
+// modulus. CG needs no matrix: each product scatters K G d through the P2G
+// path into grid.vel. Preconditioned by M, which converges in fewer
+// iterations than the full diagonal of the system here.
+
+// dt^2 times the volume and bulk modulus (density * dp/ddensity) of a
+// particle, 0 where FluidStress() clamps the pressure
+template <typename Kernel>
+float PressureStiffness(const Particle& p, const Stencil<Kernel>& s,
+                        uint32_t base_index, const int32_t* stencil) {
+    float density = rest_density / p.J;
+    if (!volume_ratio()) {
+        density = 0.0f;
+        for (uint32_t gx = 0; gx < Kernel::width; ++gx)
+            for (uint32_t gy = 0; gy < Kernel::width; ++gy)
+                for (uint32_t gz = 0; gz < Kernel::width; ++gz)
+                    density += grid.mass[base_index + stencil[(gx * Kernel::width + gy) * Kernel::width + gz]] *
+                               s.Weight(gx, gy, gz);
+    }
+
+    float ratio = std::pow(density / rest_density, eos_power);
+    if (eos_stiffness * (ratio - 1.0f) < -0.1f)
+        return 0.0f;
+    float volume = p.mass / density;
+    return dt * dt * volume * eos_stiffness * eos_power * ratio;
+}
+
+// Gathers the divergence of `d` at a particle and scatters the momentum of
+// the pressure it would build over dt
+template <typename Kernel, typename Layout, typename Sink>
+void ScatterPressure(const Layout& layout, const glm::vec3* d, const Particle& p, Sink& sink) {
+    Stencil<Kernel> s(p.pos);
+
+    uint32_t base_index = layout.Index(s.base);
+    const int32_t* stencil = layout.template Stencil<Kernel::width>(s.base);
+
+    float stiffness = PressureStiffness(p, s, base_index, stencil);
+    if (stiffness == 0.0f)
+        return;
+
+    // The gradient of a weight is inverse_D * weight * cell_dist
+    float divergence = 0.0f;
+    for (uint32_t gx = 0; gx < Kernel::width; ++gx) {
+        for (uint32_t gy = 0; gy < Kernel::width; ++gy) {
+            for (uint32_t gz = 0; gz < Kernel::width; ++gz) {
+                glm::uvec3 cell_pos = s.base + glm::uvec3(gx, gy, gz);
+                glm::vec3 cell_dist = (glm::vec3(cell_pos) - p.pos) + 0.5f;
+                uint32_t cell_index = base_index + stencil[(gx * Kernel::width + gy) * Kernel::width + gz];
+                divergence += s.Weight(gx, gy, gz) * glm::dot(d[cell_index], cell_dist);
+            }
+        }
+    }
+    float term = stiffness * Kernel::inverse_D * Kernel::inverse_D * divergence;
+
+    sink.Begin(s.base);
+    for (uint32_t gx = 0; gx < Kernel::width; ++gx) {
+        for (uint32_t gy = 0; gy < Kernel::width; ++gy) {
+            for (uint32_t gz = 0; gz < Kernel::width; ++gz) {
+                float weight = s.Weight(gx, gy, gz);
+                glm::uvec3 cell_pos = s.base + glm::uvec3(gx, gy, gz);
+                glm::vec3 cell_dist = (glm::vec3(cell_pos) - p.pos) + 0.5f;
+                sink.AddVel(sink.Index(gx, gy, gz), (term * weight) * cell_dist);
+            }
+        }
+    }
+}
+
+// Runs ScatterPressure() over the particles, into grid.vel which has to be
+// zero
+template <typename Kernel, typename P, typename Layout>
+void ScatterPressureTerms(const Layout& layout, Span<glm::vec3> d) {
+    ScatterParticles<Kernel, P>(layout, false, [&layout, d](const Particle& p, auto& sink) {
+        ScatterPressure<Kernel>(layout, d.data, p, sink);
+    });
+}
+
+// Sum of f(x, y, z, cell_index) over the cells of the active blocks, added
+// up in the same order whatever the number of threads
+template <typename Layout, typename F>
+double SumActiveCells(const Layout& layout, F f) {
+    Span<double> partial = step_arena.Allocate<double>(active_blocks.size());
+    pool->ParallelFor(0, active_blocks.size(), 16, [&](uint32_t first, uint32_t last) {
+        for (uint32_t i = first; i < last; ++i) {
+            double sum = 0.0;
+            ForEachBlockCell(layout, active_blocks[i], [&](int x, int y, int z, uint32_t cell_index) {
+                sum += f(x, y, z, cell_index);
+            });
+            partial[i] = sum;
+        }
+    });
+    double sum = 0.0;
+    for (double value: partial)
+        sum += value;
+    return sum;
+}
+
+// `vel` with the components CG does not solve for zeroed: those of empty
+// cells and those through the walls
+inline glm::vec3 Unknowns(int x, int y, int z, uint32_t cell_index, glm::vec3 vel) {
+    if (grid.mass[cell_index] <= 0.0f)
+        return glm::vec3(0.0f);
+    ApplyWalls(x, y, z, vel);
+    return vel;
+}
+
+// Zeroes the planes the P2G path scatters velocity into
+inline void ClearVelocity(uint32_t cell_index) {
+    grid.vel[cell_index] = glm::vec3(0.0f);
+    if (deterministic_in_use)
+        fixed_grid.vel[cell_index] = glm::i64vec3(0);
+}
+
+template <typename Kernel, typename P, typename Layout>
+void ImplicitPressure(const Layout& layout) {
+    size_t cells = grid.mass.size();
+    Span<glm::vec3> v = step_arena.Allocate<glm::vec3>(cells);
+    Span<glm::vec3> r = step_arena.Allocate<glm::vec3>(cells);
+    Span<glm::vec3> d = step_arena.Allocate<glm::vec3>(cells);
+    Span<glm::vec3> q = step_arena.Allocate<glm::vec3>(cells);
+    auto precondition = [](uint32_t cell_index, const glm::vec3& residual) {
+        float mass = grid.mass[cell_index];
+        return mass > 0.0f ? residual / mass : glm::vec3(0.0f);
+    };
+
+    // v starts at v*, the right hand side M v* gives the scale of the
+    // tolerance
+    double reference = SumActiveCells(layout, [&](int, int, int, uint32_t cell_index) {
+        v[cell_index] = grid.vel[cell_index];
+        d[cell_index] = v[cell_index];
+        ClearVelocity(cell_index);
+        return grid.mass[cell_index] * glm::dot(v[cell_index], v[cell_index]);
+    });
+    double threshold = (double)pressure_tolerance * pressure_tolerance * reference;
+
+    // r = M v* - A v*
+    ScatterPressureTerms<Kernel, P>(layout, d);
+    double rz = SumActiveCells(layout, [&](int x, int y, int z, uint32_t cell_index) {
+        r[cell_index] = -Unknowns(x, y, z, cell_index, grid.vel[cell_index]);
+        d[cell_index] = precondition(cell_index, r[cell_index]);
+        ClearVelocity(cell_index);
+        return glm::dot(r[cell_index], d[cell_index]);
+    });
+
+    int iteration = 0;
+    for (; iteration < pressure_max_iterations && rz > threshold; ++iteration) {
+        // q = A d, leaving grid.vel cleared for the next product
+        ScatterPressureTerms<Kernel, P>(layout, d);
+        double curvature = SumActiveCells(layout, [&](int x, int y, int z, uint32_t cell_index) {
+            glm::vec3 product = grid.mass[cell_index] * d[cell_index] + grid.vel[cell_index];
+            q[cell_index] = Unknowns(x, y, z, cell_index, product);
+            ClearVelocity(cell_index);
+            return glm::dot(d[cell_index], q[cell_index]);
+        });
+        if (!(curvature > 0.0))
+            break;
+
+        float alpha = (float)(rz / curvature);
+        double rz_next = SumActiveCells(layout, [&](int, int, int, uint32_t cell_index) {
+            v[cell_index] += alpha * d[cell_index];
+            r[cell_index] -= alpha * q[cell_index];
+            return glm::dot(r[cell_index], precondition(cell_index, r[cell_index]));
+        });
+        float beta = (float)(rz_next / rz);
+        rz = rz_next;
+        ForEachActiveCell(layout, [&](int, int, int, uint32_t cell_index) {
+            d[cell_index] = precondition(cell_index, r[cell_index]) + beta * d[cell_index];
+        });
+    }
+    pressure_iterations = iteration;
+
+    ForEachActiveCell(layout, [v](int, int, int, uint32_t cell_index) {
+        grid.vel[cell_index] = v[cell_index];
+        if (half_grid_in_use)
+            grid.half_vel[cell_index] = v[cell_index];
+    });
+}
+
+// Gathers the particle's velocity (and under APIC its affine matrix) from
+// the `vel` plane of a grid, then advects it. FLIP also reads the velocity
+// before the update from `old_vel`.
+template <typename Transfer, typename Kernel, typename Level = BaseLevel, typename Layout, typename Vel>
+void GatherParticle(const Layout& layout, const Vel* vel, const glm::vec3* old_vel, Particle& p) {
+    glm::vec3 particle_vel = p.vel;
+    glm::vec3 flip_delta = glm::vec3(0.0f);
+    float divergence = 0.0f;
+    p.vel = glm::vec3(0.0f);
+
+    glm::vec3 pos = Level::ToLevel(p.pos);
+    Stencil<Kernel> s(pos);
+    uint32_t base_index = layout.Index(s.base);
+    const int32_t* stencil = layout.template Stencil<Kernel::width>(s.base);
+
+    glm::mat3 B = glm::mat3(0.0f);
+    for (uint32_t gx = 0; gx < Kernel::width; ++gx) {
+        for (uint32_t gy = 0; gy < Kernel::width; ++gy) {
+            for (uint32_t gz = 0; gz < Kernel::width; ++gz) {
+                float weight = s.Weight(gx, gy, gz);
+                glm::uvec3 cell_pos = s.base + glm::uvec3(gx, gy, gz);
+                glm::vec3 cell_dist = (glm::vec3(cell_pos) - pos) + 0.5f;
+
+                uint32_t cell_index = base_index + stencil[(gx * Kernel::width + gy) * Kernel::width + gz];
+
+                glm::vec3 cell_vel = glm::vec3(vel[cell_index]);
+                glm::vec3 weighted_velocity = cell_vel * weight;
+
+                if constexpr (Transfer::affine) {
+                    B += glm::mat3(weighted_velocity * cell_dist.x,
+                                   weighted_velocity * cell_dist.y,
+                                   weighted_velocity * cell_dist.z);
+                } else {
+                    divergence += glm::dot(weighted_velocity, cell_dist);
+                }
+                if constexpr (Transfer::flip)
+                    flip_delta += (cell_vel - old_vel[cell_index]) * weight;
+
+                p.vel += weighted_velocity;
+            }
+        }
+    }
+
+    // The volume follows the divergence of the velocity field, trace(C).
+    // Clamped, an isolated particle keeps its C and would grow forever.
+    const float inverse_D = Kernel::inverse_D / Level::scale;
+    float trace = inverse_D * divergence;
+    if constexpr (Transfer::affine) {
+        p.C = B * inverse_D;
+        trace = p.C[0][0] + p.C[1][1] + p.C[2][2];
+    }
+    if (volume_ratio()) {
+        p.J *= 1.0f + dt * trace;
+        p.J = glm::clamp(p.J, min_J, max_J);
+    }
+    if constexpr (Transfer::flip)
+        p.vel = glm::mix(p.vel, particle_vel + flip_delta, flip_blend);
+    p.vel *= damping;
+    p.pos += p.vel * dt;
+    // Keeps the stencil inside the grid
+    p.pos = glm::clamp(p.pos, glm::vec3((float)Kernel::reach), glm::vec3(grid_size) - 1.0f - (float)Kernel::reach);
+
+    // Walls of the domain, in grid coordinates
+    glm::vec3 x_n = p.pos + p.vel;
+    const glm::vec3 wall_min = glm::vec3(3 - grid_origin);
+    const glm::vec3 wall_max = glm::vec3(domain_in_use - 4 - grid_origin);
+    if (x_n.x < wall_min.x) p.vel.x += (wall_min.x - x_n.x);
+    if (x_n.x > wall_max.x) p.vel.x += (wall_max.x - x_n.x);
+    if (x_n.y < wall_min.y) p.vel.y += (wall_min.y - x_n.y);
+    if (x_n.y > wall_max.y) p.vel.y += (wall_max.y - x_n.y);
+    if (x_n.z < wall_min.z) p.vel.z += (wall_min.z - x_n.z);
+    if (x_n.z > wall_max.z) p.vel.z += (wall_max.z - x_n.z);
+}
+
+// Calls f(vel) with the velocity plane of `source` that G2P reads
+template <typename F>
+void WithGatherVelocity(const Grid& source, F f) {
+    if (half_grid_in_use)
+        f(source.half_vel.data());
+    else
+        f(source.vel.data());
+}
+
+// GatherParticle() on a stored particle, in place when it is a Particle.
+// The particle comes back unpacked, as it is stored after the rounding.
+template <typename Transfer, typename Kernel, typename Level = BaseLevel, typename Layout, typename Vel,
+          typename P>
+Particle GatherStored(const Layout& layout, const Vel* vel, const glm::vec3* old_vel, P& stored) {
+    if constexpr (std::is_same_v<P, Particle>) {
+        GatherParticle<Transfer, Kernel, Level>(layout, vel, old_vel, stored);
+        return stored;
+    } else {
+        Particle p = Unpack(stored);
+        GatherParticle<Transfer, Kernel, Level>(layout, vel, old_vel, p);
+        Pack(stored, p);
+        return Unpack(stored);
+    }
+}
+
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void G2P(const Layout& layout) {
+    auto& stored = ParticleStorage<P>();
+    bool sleep = sleeping();
+    WithGatherVelocity(grid, [&](const auto* vel) {
+        pool->ParallelFor(0, stored.size(), 1024, [&](uint32_t first, uint32_t last) {
+            for (uint32_t i = first; i < last; ++i) {
+                // The particles of stopped bins stay frozen
+                if (sleep && block_rest[particle_bin[i]].state != BlockRest::AWAKE)
+                    continue;
+                GatherStored<Transfer, Kernel>(layout, vel, grid.old_vel.data(), stored[i]);
+            }
+        });
+    });
+}
+
+// G2P of this step and P2G of the next one in a single sweep: each particle
+// is gathered from back_grid (this step's updated grid), advected, and
+// scattered into the cleared `grid` right away while it is still in cache.
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void FusedTransfer(const Layout& layout) {
+    GridSink<Layout, Kernel> sink(layout, grid);
+    WithGatherVelocity(back_grid, [&](const auto* vel) {
+        for (auto& stored: ParticleStorage<P>()) {
+            Particle p = GatherStored<Transfer, Kernel>(layout, vel, back_grid.old_vel.data(), stored);
+            MarkActive<Kernel>(glm::uvec3(p.pos));
+            ScatterFluid<Transfer, Kernel>(p, sink);
+        }
+    });
+}
+
+// Task graph of a P2G_TILES step, at the granularity of the bins and blocks:
+// SCATTER_1 (and SCATTER_2 under FLUID_GATHER) per occupied bin, UPDATE per
+// active block, GATHER (G2P) per occupied bin. A block's update waits for
+// the bins around it to have scattered, a bin's G2P for the blocks around it
+// to be updated, instead of every phase waiting for the whole domain.
+struct StepGraph {
+    enum Stage { SCATTER_1, SCATTER_2, UPDATE, GATHER, STAGES };
+
+    // All in the step arena
+    uint32_t stage_start[STAGES + 1]; // First task of each stage
+    Span<int32_t> bin_slot;           // Index in occupied_bins by bin, or -1
+    Span<int32_t> block_slot;         // Index in active_blocks by block, or -1
+
+    // Successors of task t are successors[successor_offsets[t] .. [t + 1]]
+    Span<uint32_t> successor_offsets;
+    Span<uint32_t> successors;
+    Span<std::atomic<uint32_t>> waiting; // Unfinished predecessors
+
+    Stage StageOf(uint32_t task) const {
+        int stage = SCATTER_1;
+        while (task >= stage_start[stage + 1])
+            stage++;
+        return (Stage)stage;
+    }
+};
+
+StepGraph step_graph;
+
+// Calls f(neighbour) for the blocks within `radius` blocks of `block`
+template <typename F>
+void ForEachNeighbourBlock(uint32_t block, int radius, F f) {
+    glm::ivec3 b = glm::ivec3(BlockCoords(block));
+    glm::ivec3 lo = glm::max(b - radius, glm::ivec3(0));
+    glm::ivec3 hi = glm::min(b + radius, grid_blocks - 1);
+    for (int z = lo.z; z <= hi.z; ++z)
+        for (int y = lo.y; y <= hi.y; ++y)
+            for (int x = lo.x; x <= hi.x; ++x)
+                f(BlockIndex(glm::uvec3(x, y, z)));
+}
+
+// Builds the graph for the current bins and active blocks
+void BuildStepGraph() {
+    StepGraph& g = step_graph;
+    uint32_t bins = occupied_bins.size();
+    uint32_t blocks = active_blocks.size();
+
+    g.bin_slot = step_arena.Allocate<int32_t>(BlockCount(), -1);
+    g.block_slot = step_arena.Allocate<int32_t>(BlockCount(), -1);
+    for (uint32_t i = 0; i < bins; ++i)
+        g.bin_slot[occupied_bins[i]] = i;
+    for (uint32_t i = 0; i < blocks; ++i)
+        g.block_slot[active_blocks[i]] = i;
+
+    g.stage_start[StepGraph::SCATTER_1] = 0;
+    g.stage_start[StepGraph::SCATTER_2] = bins;
+    g.stage_start[StepGraph::UPDATE] = volume_ratio() ? bins : 2 * bins;
+    g.stage_start[StepGraph::GATHER] = g.stage_start[StepGraph::UPDATE] + blocks;
+    g.stage_start[StepGraph::STAGES] = g.stage_start[StepGraph::GATHER] + bins;
+    uint32_t tasks = g.stage_start[StepGraph::STAGES];
+    uint32_t last_scatter = g.stage_start[StepGraph::UPDATE] - bins;
+
+    g.waiting = step_arena.Allocate<std::atomic<uint32_t>>(tasks);
+    for (uint32_t t = 0; t < tasks; ++t)
+        g.waiting[t].store(0, std::memory_order_relaxed);
+    g.successor_offsets = step_arena.Allocate<uint32_t>(tasks + 1, 0);
+
+    // Enumerated twice, to count then to fill the successor lists
+    auto edges = [&](auto emit) {
+        for (uint32_t i = 0; i < bins; ++i) {
+            // SCATTER_2 gathers the mass of the blocks around its bin, which
+            // the bins up to two blocks away contribute to
+            if (!volume_ratio()) {
+                ForEachNeighbourBlock(occupied_bins[i], 2, [&](uint32_t bin) {
+                    if (g.bin_slot[bin] >= 0)
+                        emit(g.stage_start[StepGraph::SCATTER_1] + i,
+                             g.stage_start[StepGraph::SCATTER_2] + g.bin_slot[bin]);
+                });
+            }
+            ForEachNeighbourBlock(occupied_bins[i], 1, [&](uint32_t block) {
+                if (g.block_slot[block] >= 0)
+                    emit(last_scatter + i, g.stage_start[StepGraph::UPDATE] + g.block_slot[block]);
+            });
+        }
+        for (uint32_t i = 0; i < blocks; ++i) {
+            ForEachNeighbourBlock(active_blocks[i], 1, [&](uint32_t bin) {
+                if (g.bin_slot[bin] >= 0)
+                    emit(g.stage_start[StepGraph::UPDATE] + i,
+                         g.stage_start[StepGraph::GATHER] + g.bin_slot[bin]);
+            });
+        }
+    };
+
+    edges([&](uint32_t from, uint32_t to) {
+        g.successor_offsets[from + 1]++;
+        g.waiting[to].fetch_add(1, std::memory_order_relaxed);
+    });
+    for (uint32_t t = 0; t < tasks; ++t)
+        g.successor_offsets[t + 1] += g.successor_offsets[t];
+    g.successors = step_arena.Allocate<uint32_t>(g.successor_offsets[tasks]);
+
+    Span<uint32_t> fill = step_arena.Allocate<uint32_t>(tasks);
+    std::copy(g.successor_offsets.begin(), g.successor_offsets.end() - 1, fill.begin());
+    edges([&](uint32_t from, uint32_t to) {
+        g.successors[fill[from]++] = to;
+    });
+}
+
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void RunStepTask(void* context, uint32_t task) {
+    const Layout& layout = *(const Layout*)context;
+    StepGraph& g = step_graph;
+
+    StepGraph::Stage stage = g.StageOf(task);
+    uint32_t slot = task - g.stage_start[stage];
+    if (stage == StepGraph::UPDATE) {
+        ForEachBlockCell(layout, active_blocks[slot], UpdateCell<Transfer>);
+    } else {
+        uint32_t bin = occupied_bins[slot];
+        uint32_t first = bin_offsets[bin], last = bin_offsets[bin + 1];
+        if (stage == StepGraph::GATHER) {
+            WithGatherVelocity(grid, [&](const auto* vel) {
+                for (uint32_t k = first; k < last; ++k)
+                    GatherStored<Transfer, Kernel>(layout, vel, grid.old_vel.data(),
+                                           ParticleStorage<P>()[bin_particles[k]]);
+            });
+        } else {
+            using Tile = KERNEL_ISA::Tile<FloatAccumulator, Kernel>;
+            Tile& tile = *Tiles<Tile>()[ThreadPool::WorkerIndex()];
+            tile.Reset(bin, split_stress());
+            TileSink<FloatAccumulator, Kernel> sink(tile);
+            for (uint32_t k = first; k < last; ++k) {
+                const Particle& p = Unpack(ParticleStorage<P>()[bin_particles[k]]);
+                if (volume_ratio())
+                    ScatterFluid<Transfer, Kernel>(p, sink);
+                else if (stage == StepGraph::SCATTER_1)
+                    ScatterMass<Transfer, Kernel>(p, sink);
+                else
+                    ScatterStress<Transfer, Kernel>(layout, p, sink);
+            }
+            FlushTile(layout, tile, stage == StepGraph::SCATTER_1, split_stress());
+        }
+    }
+
+    for (uint32_t n = g.successor_offsets[task]; n < g.successor_offsets[task + 1]; ++n) {
+        uint32_t next = g.successors[n];
+        if (g.waiting[next].fetch_sub(1, std::memory_order_acq_rel) == 1)
+            pool->Submit({RunStepTask<Transfer, Kernel, P, Layout>, context, next});
+    }
+}
+
+// P2G, GridUpdate and G2P of a P2G_TILES step as one task graph
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void RunStepGraph(const Layout& layout) {
+    BinParticles<Kernel, P>();
+    BuildStepGraph();
+    AllocateTiles<Tile<FloatAccumulator, Kernel>>();
+    // SCATTER_1 tasks are the roots, the rest is submitted by the tasks that
+    // complete their predecessors
+    for (uint32_t t = 0; t < step_graph.stage_start[StepGraph::SCATTER_2]; ++t)
+        pool->Submit({RunStepTask<Transfer, Kernel, P, Layout>, (void*)&layout, t});
+    pool->Wait();
+}
+
+// Ping-pong between `grid` and `back_grid`, along with their active blocks
+void SwapGrids() {
+    std::swap(grid, back_grid);
+    std::swap(block_active, back_block_active);
+    std::swap(active_blocks, back_active_blocks);
+}
+
+// Trades `grid` with the coarse level, along with their active blocks and
+// sizes
+void SwapLevels() {
+    std::swap(grid, coarse_grid);
+    std::swap(block_active, coarse_block_active);
+    std::swap(active_blocks, coarse_active_blocks);
+    std::swap(grid_size, coarse_size);
+    std::swap(grid_blocks, coarse_blocks);
+}
+
+// Block of `grid` holding a particle
+inline uint32_t ParticleBlock(const glm::vec3& pos) {
+    return BlockIndex(glm::uvec3(pos) / (uint32_t)block_size);
+}
+
+// block_level of every particle's block this step
+Span<uint8_t> particle_level;
+
+// Sets block_level and particle_level for this step. The fine blocks, whose particles gather
+// from `grid`, are the occupied ones with detail: a face neighbour in the
+// grid without particles, or a particle faster than refine_velocity.
+// Fastest first, as many as fine_block_budget allows with the blocks their
+// particles' stencils may share cells with. Those scatter to `grid` too,
+// and every block within the same reach of a coarse block scatters to the
+// coarse level.
+template <typename Kernel, typename P>
+void ClassifyLevels() {
+    const auto& stored = ParticleStorage<P>();
+    uint32_t blocks = BlockCount();
+    Span<uint32_t> count = step_arena.Allocate<uint32_t>(blocks, 0);
+    Span<float> speed = step_arena.Allocate<float>(blocks, 0.0f); // Squared, of the fastest
+    for (const P& p: stored) {
+        uint32_t block = ParticleBlock(p.pos);
+        glm::vec3 vel = glm::vec3(p.vel);
+        count[block]++;
+        speed[block] = std::max(speed[block], glm::dot(vel, vel));
+    }
+
+    Span<uint32_t> detail = step_arena.Allocate<uint32_t>(blocks);
+    detail.count = 0;
+    const glm::ivec3 faces[6] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+    for (uint32_t block = 0; block < blocks; ++block) {
+        if (count[block] == 0)
+            continue;
+        bool surface = false;
+        glm::ivec3 b = glm::ivec3(BlockCoords(block));
+        for (const glm::ivec3& face: faces) {
+            glm::ivec3 n = b + face;
+            if (glm::all(glm::greaterThanEqual(n, glm::ivec3(0))) && glm::all(glm::lessThan(n, grid_blocks)))
+                surface |= count[BlockIndex(glm::uvec3(n))] == 0;
+        }
+        if (surface || speed[block] > refine_velocity * refine_velocity)
+            detail[detail.count++] = block;
+    }
+    std::sort(detail.begin(), detail.end(), [&speed](uint32_t a, uint32_t b) {
+        return speed[a] > speed[b] || (speed[a] == speed[b] && a < b);
+    });
+
+    // Particles share cells of a level within two stencil reaches
+    const int fine_reach = (2 * (Kernel::reach + 1) + block_size - 1) / block_size;
+    const int coarse_reach = (2 * (Kernel::reach + 1) * CoarseLevel::scale + block_size - 1) / block_size;
+    block_level.assign(blocks, 0);
+    fine_blocks = 0;
+    for (uint32_t block: detail) {
+        int added = 0;
+        ForEachNeighbourBlock(block, fine_reach, [&added](uint32_t n) {
+            added += !(block_level[n] & LEVEL_FINE_SCATTER);
+        });
+        if (fine_block_budget > 0 && fine_blocks + added > fine_block_budget)
+            continue;
+        block_level[block] |= LEVEL_FINE_GATHER;
+        ForEachNeighbourBlock(block, fine_reach, [](uint32_t n) {
+            block_level[n] |= LEVEL_FINE_SCATTER;
+        });
+        fine_blocks += added;
+    }
+    for (uint32_t block = 0; block < blocks; ++block) {
+        if (count[block] > 0 && !(block_level[block] & LEVEL_FINE_GATHER)) {
+            ForEachNeighbourBlock(block, coarse_reach, [](uint32_t n) {
+                block_level[n] |= LEVEL_COARSE_SCATTER;
+            });
+        }
+    }
+
+    particle_level = step_arena.Allocate<uint8_t>(stored.size());
+    for (uint32_t i = 0; i < stored.size(); ++i)
+        particle_level[i] = block_level[ParticleBlock(stored[i].pos)];
+}
+
+// P2G_SCATTER into `grid`, holding the Level, of the particles whose
+// particle_level has `flag`
+template <typename Transfer, typename Kernel, typename P, typename Level, typename Layout>
+void P2GLevel(const Layout& layout, uint8_t flag) {
+    const auto& stored = ParticleStorage<P>();
+    GridSink<Layout, Kernel> sink(layout, grid);
+    if (volume_ratio()) {
+        for (uint32_t i = 0; i < stored.size(); ++i) {
+            if (!(particle_level[i] & flag))
+                continue;
+            Particle p = Unpack(stored[i]);
+            MarkActive<Kernel>(glm::uvec3(Level::ToLevel(p.pos)));
+            ScatterFluid<Transfer, Kernel, Level>(p, sink);
+        }
+    } else {
+        for (uint32_t i = 0; i < stored.size(); ++i) {
+            if (!(particle_level[i] & flag))
+                continue;
+            Particle p = Unpack(stored[i]);
+            MarkActive<Kernel>(glm::uvec3(Level::ToLevel(p.pos)));
+            ScatterMass<Transfer, Kernel, Level>(p, sink);
+        }
+        for (uint32_t i = 0; i < stored.size(); ++i) {
+            if (particle_level[i] & flag)
+                ScatterStress<Transfer, Kernel, Level>(layout, Unpack(stored[i]), sink);
+        }
+    }
+}
+
+// G2P with each particle gathering from the level of its block
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void G2PLevels(const Layout& layout) {
+    auto& stored = ParticleStorage<P>();
+    const auto& coarse_layout = CoarseLayout(layout);
+    WithGatherVelocity(grid, [&](const auto* vel) {
+        WithGatherVelocity(coarse_grid, [&](const auto* coarse_vel) {
+            pool->ParallelFor(0, stored.size(), 1024, [&](uint32_t first, uint32_t last) {
+                for (uint32_t i = first; i < last; ++i) {
+                    if (particle_level[i] & LEVEL_FINE_GATHER)
+                        GatherStored<Transfer, Kernel>(layout, vel, grid.old_vel.data(), stored[i]);
+                    else
+                        GatherStored<Transfer, Kernel, CoarseLevel>(coarse_layout, coarse_vel,
+                                                                    coarse_grid.old_vel.data(), stored[i]);
+                }
+            });
+        });
+    });
+}
+
+// A step through both levels of the grid: P2G and update of `grid` for the
+// fine blocks, then of the coarse level for the others, then G2P
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void SimulateLevels(const Layout& layout) {
+    ClassifyLevels<Kernel, P>();
+    ClearGrid(layout);
+    P2GLevel<Transfer, Kernel, P, BaseLevel>(layout, LEVEL_FINE_SCATTER);
+    GridUpdate<Transfer>(layout);
+
+    const Layout& coarse_layout = CoarseLayout(layout);
+    SwapLevels();
+    ClearGrid(coarse_layout);
+    P2GLevel<Transfer, Kernel, P, CoarseLevel>(coarse_layout, LEVEL_COARSE_SCATTER);
+    GridUpdate<Transfer, CoarseLevel>(coarse_layout);
+    SwapLevels();
+    G2PLevels<Transfer, Kernel, P>(layout);
+}
+
+// Step of a distributed run, on the grid of the rank's slab. The cells away
+// from the slab's edges are updated while the halo's sums travel, and the
+// particles whose stencil stays in the slab gather while the edges'
+// velocities do.
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void SimulateSlab(const Layout& layout) {
+    const int first = slab_exchange->first, last = slab_exchange->last, halo = slab_exchange->halo;
+    ClearGrid(layout);
+    P2G<Transfer, Kernel, P>(layout);
+
+    slab_exchange->post_grid();
+    ForEachActiveCell(layout, [=](int x, int y, int z, uint32_t cell_index) {
+        if (x >= first + halo && x < last - halo)
+            UpdateCell<Transfer>(x, y, z, cell_index);
+    });
+    slab_exchange->finish_grid();
+    ForEachActiveCell(layout, [=](int x, int y, int z, uint32_t cell_index) {
+        if (x < first + halo || x >= last - halo)
+            UpdateCell<Transfer>(x, y, z, cell_index);
+    });
+
+    slab_exchange->post_velocity();
+    auto& stored = ParticleStorage<P>();
+    Span<uint8_t> waits = step_arena.Allocate<uint8_t>(stored.size());
+    WithGatherVelocity(grid, [&](const auto* vel) {
+        pool->ParallelFor(0, stored.size(), 1024, [&](uint32_t first_particle, uint32_t last_particle) {
+            for (uint32_t i = first_particle; i < last_particle; ++i) {
+                int x = (int)stored[i].pos.x;
+                waits[i] = x - Kernel::reach < first || x + Kernel::reach >= last;
+                if (!waits[i])
+                    GatherStored<Transfer, Kernel>(layout, vel, grid.old_vel.data(), stored[i]);
+            }
+        });
+        slab_exchange->finish_velocity();
+        pool->ParallelFor(0, stored.size(), 1024, [&](uint32_t first_particle, uint32_t last_particle) {
+            for (uint32_t i = first_particle; i < last_particle; ++i)
+                if (waits[i])
+                    GatherStored<Transfer, Kernel>(layout, vel, grid.old_vel.data(), stored[i]);
+        });
+    });
+}
+
+template <typename Transfer, typename Kernel, typename P, typename Layout>
+void Simulate(const Layout& layout) {
+    if (slab_exchange) {
+        SimulateSlab<Transfer, Kernel, P>(layout);
+        return;
+    }
+    if (task_graph && p2g_mode == P2G_TILES && !deterministic_in_use &&
+        pressure_in_use == PRESSURE_EXPLICIT && !sleep_in_use) {
+        ClearGrid(layout);
+        RunStepGraph<Transfer, Kernel, P>(layout);
+        return;
+    }
+    if (levels_in_use && p2g_mode == P2G_SCATTER) {
+        SimulateLevels<Transfer, Kernel, P>(layout);
+        return;
+    }
+    if (!fused_in_use) {
+        ClearGrid(layout);
+        P2G<Transfer, Kernel, P>(layout);
+        GridUpdate<Transfer>(layout);
+        if (pressure_in_use == PRESSURE_IMPLICIT)
+            ImplicitPressure<Kernel, P>(layout);
+        if (sleeping())
+            UpdateSleep(layout);
+        else if (sleep_in_use)
+            WakeBlocks(); // P2G_SCATTER moves every particle
+        G2P<Transfer, Kernel, P>(layout);
+        return;
+    }
+
+    // `grid` holds this step's P2G, done by the previous step (or here on
+    // the first one)
+    if (!fused_primed) {
+        ClearGrid(layout);
+        P2G<Transfer, Kernel, P>(layout);
+        fused_primed = true;
+    }
+    GridUpdate<Transfer>(layout);
+    if (pressure_in_use == PRESSURE_IMPLICIT)
+        ImplicitPressure<Kernel, P>(layout);
+    SwapGrids();
+    ClearGrid(layout);
+    FusedTransfer<Transfer, Kernel, P>(layout);
+}
+
+void Step() {
+    WithTransfer([](auto* transfer) {
+        using Transfer = std::remove_pointer_t<decltype(transfer)>;
+        WithKernel([](auto* kernel) {
+            using Kernel = std::remove_pointer_t<decltype(kernel)>;
+            WithParticleStorage([](auto* storage) {
+                using P = std::remove_pointer_t<decltype(storage)>;
+                // Only APIC stores C, compact particles only go with the
+                // quadratic kernel
+                if constexpr (Transfer::affine == StoresAffine<P>() &&
+                              (std::is_same_v<Kernel, QuadraticBSpline> ||
+                               std::is_same_v<P, Particle> || std::is_same_v<P, VelocityParticle>)) {
+                    if (layout_in_use == GRID_TILED)
+                        Simulate<Transfer, Kernel, P>(tiled_layout);
+                    else
+                        Simulate<Transfer, Kernel, P>(linear_layout);
+                }
+            });
+        });
+    });
+}
+
+} // namespace KERNEL_ISA
@@ -0,0 +1,272 @@
+#pragma once
+
+// Solver state shared by Simulation.cpp and the per instruction set builds
+// of the step kernels, see SimulationKernels.hpp. Not part of the solver's
+// interface.
+
+#include "Simulation.hpp"
+#include "Arena.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtx/compatibility.hpp>
+#include <glm/gtx/scalar_multiplication.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Layout `grid` was built with by the last Init()
+extern GridLayout layout_in_use;
+
+// Domain of the last Init() and where the grid window sits in it
+extern glm::ivec3 domain_in_use;
+extern glm::ivec3 grid_origin;
+extern glm::ivec3 grid_size;
+// Blocks along each axis of the grid window, in row-major order
+extern glm::ivec3 grid_blocks;
+
+inline uint32_t BlockCount() {
+    return grid_blocks.x * grid_blocks.y * grid_blocks.z;
+}
+
+inline uint32_t BlockIndex(glm::uvec3 b) {
+    return b.x + (b.y + b.z * grid_blocks.y) * grid_blocks.x;
+}
+
+inline glm::uvec3 BlockCoords(uint32_t block) {
+    return glm::uvec3(block % grid_blocks.x,
+                      (block / grid_blocks.x) % grid_blocks.y,
+                      block / (grid_blocks.x * grid_blocks.y));
+}
+
+// Blocks of block_size^3 cells touched by P2G this step, as flags and as a
+// compact list. Cells outside of the listed blocks are always zero.
+extern std::vector<uint8_t> block_active;
+extern std::vector<uint32_t> active_blocks;
+
+// Scratch of the current step and the number of steps taken
+extern Arena step_arena;
+extern uint64_t step_count;
+
+extern std::unique_ptr<ThreadPool> pool;
+
+// Second grid of the fused transfers and its active blocks
+extern Grid back_grid;
+extern std::vector<uint8_t> back_block_active;
+extern std::vector<uint32_t> back_active_blocks;
+extern bool fused_in_use;
+extern bool fused_primed;
+
+// Particle indices sorted by the block of their cell, see BinParticles()
+extern Span<uint32_t> bin_offsets;
+extern Span<uint32_t> bin_particles;
+extern Span<uint32_t> particle_bin;
+extern Span<uint32_t> occupied_bins;
+
+extern FixedGrid fixed_grid;
+extern bool deterministic_in_use;
+
+// Transfer and storage settings of the last Init()
+extern TransferScheme transfer_in_use;
+extern KernelOrder kernel_order_in_use;
+extern Precision affine_in_use;
+extern bool packed_velocity_in_use;
+extern bool half_grid_in_use;
+extern PressureSolver pressure_in_use;
+
+// Whether the density comes from the particles' J. FLIP particles do not
+// move with the grid velocity whose divergence J follows, so J drifts from
+// their actual spacing until it sits at min_J and the fluid collapses:
+// FLIP gathers the density.
+inline bool volume_ratio() {
+    return fluid_model == FLUID_VOLUME_RATIO && transfer_in_use != TRANSFER_FLIP;
+}
+
+extern int pressure_iterations;
+
+// Rest of a block under sleeping_blocks, see UpdateSleep(). A DROWSY block
+// has its particles frozen and caches their contribution in its next P2G.
+struct BlockRest {
+    enum State : uint8_t { AWAKE, DROWSY, ASLEEP };
+    State state;
+    uint16_t rest_steps; // At rest in a row
+    uint32_t particles;  // Of the block's bin when it stopped, to notice arrivals
+    float mass;          // Grid mass of the block's cells last step
+};
+
+extern bool sleep_in_use;
+extern std::vector<BlockRest> block_rest;
+
+// Levels of the grid under grid_levels as the kernels' template parameter:
+// the size of their cells in cells of `grid`, and how many padding cells
+// come before the grid's corner. A particle at `pos` sits at ToLevel(pos)
+// in the level's cells.
+struct BaseLevel {
+    static const int scale = 1;
+    static const int pad = 0;
+    static glm::vec3 ToLevel(const glm::vec3& pos) { return pos; }
+};
+
+struct CoarseLevel {
+    static const int scale = 2;
+    static const int pad = 2; // Keeps the stencils of the grid's edge inside
+    static glm::vec3 ToLevel(const glm::vec3& pos) { return pos * 0.5f + (float)pad; }
+};
+
+// The coarse level, with its own active blocks. SwapLevels() trades it
+// with `grid` so that the kernels working on `grid` run on it.
+extern bool levels_in_use;
+extern Grid coarse_grid;
+extern std::vector<uint8_t> coarse_block_active;
+extern std::vector<uint32_t> coarse_active_blocks;
+extern glm::ivec3 coarse_size;
+extern glm::ivec3 coarse_blocks;
+extern LinearLayout coarse_linear_layout;
+extern TiledLayout coarse_tiled_layout;
+
+// Per block of `grid`, which levels its particles scatter to and gather
+// from, see ClassifyLevels(). Empty until a step classifies the blocks.
+enum : uint8_t {
+    LEVEL_FINE_GATHER = 1,
+    LEVEL_FINE_SCATTER = 2,
+    LEVEL_COARSE_SCATTER = 4
+};
+extern std::vector<uint8_t> block_level;
+extern int fine_blocks;
+
+inline const LinearLayout& CoarseLayout(const LinearLayout&) {
+    return coarse_linear_layout;
+}
+
+inline const TiledLayout& CoarseLayout(const TiledLayout&) {
+    return coarse_tiled_layout;
+}
+
+// A distributed run (see Distributed.hpp) gives each rank a slab of the
+// domain along x: the grid window holds the slab's cells [first, last)
+// plus `halo` cells on either side, which the neighbouring ranks own. The
+// step calls the exchanges between its phases, posting one and finishing
+// it once the cells that do not need it are done.
+struct SlabExchange {
+    int first, last;
+    int halo;
+    void (*exchange_mass)();   // FLUID_GATHER, between the P2G passes: completes the mass of the halo
+    void (*post_grid)();       // After P2G: sends the halo's sums to their owner
+    void (*finish_grid)();     // Adds the neighbours' sums into the slab's edges
+    void (*post_velocity)();   // After the edges' update: sends their velocity
+    void (*finish_velocity)(); // Writes the neighbours' velocities into the halo
+};
+
+// Set by InitDistributed(), null for a single process
+extern SlabExchange* slab_exchange;
+
+// Sizes the grid, and everything indexed by cell or block, to grid_size
+void AssignGrid(ThreadPool& workers);
+
+// Particles the solver steps when stored as P, `particles` itself for P =
+// Particle
+template <typename P>
+PageVector<P>& ParticleStorage() {
+    static PageVector<P> storage;
+    return storage;
+}
+
+template <>
+inline PageVector<Particle>& ParticleStorage<Particle>() {
+    return particles;
+}
+
+// Transfer schemes as the kernels' template parameter
+struct ApicTransfer {
+    static const bool affine = true;
+    static const bool flip = false;
+};
+
+struct PicTransfer {
+    static const bool affine = false;
+    static const bool flip = false;
+};
+
+struct FlipTransfer {
+    static const bool affine = false;
+    static const bool flip = true;
+};
+
+// Calls f((T*)nullptr) with T the transfer of transfer_in_use
+template <typename F>
+void WithTransfer(F f) {
+    if (transfer_in_use == TRANSFER_PIC)
+        f((PicTransfer*)nullptr);
+    else if (transfer_in_use == TRANSFER_FLIP)
+        f((FlipTransfer*)nullptr);
+    else
+        f((ApicTransfer*)nullptr);
+}
+
+// Whether particles stored as P carry C, which only ApicTransfer uses
+template <typename P>
+constexpr bool StoresAffine() {
+    return !std::is_same_v<P, VelocityParticle>;
+}
+
+// Calls f((P*)nullptr) with P the particle type of the transfer and storage
+// settings in use
+template <typename F>
+void WithParticleStorage(F f) {
+    if (transfer_in_use != TRANSFER_APIC)
+        f((VelocityParticle*)nullptr);
+    else if (affine_in_use == PRECISION_FP16 && packed_velocity_in_use)
+        f((CompactParticle<Half, true>*)nullptr);
+    else if (affine_in_use == PRECISION_FP16)
+        f((CompactParticle<Half, false>*)nullptr);
+    else if (affine_in_use == PRECISION_BF16 && packed_velocity_in_use)
+        f((CompactParticle<BFloat16, true>*)nullptr);
+    else if (affine_in_use == PRECISION_BF16)
+        f((CompactParticle<BFloat16, false>*)nullptr);
+    else
+        f((Particle*)nullptr);
+}
+
+// Conversions between the stored particles and the Particle the kernels
+// work on, free for Particle itself
+inline const Particle& Unpack(const Particle& p) {
+    return p;
+}
+
+template <typename Scalar, bool PackedVelocity>
+Particle Unpack(const CompactParticle<Scalar, PackedVelocity>& p) {
+    return {p.pos, glm::vec3(p.vel), glm::mat3(p.C), p.J, p.mass};
+}
+
+inline Particle Unpack(const VelocityParticle& p) {
+    return {p.pos, p.vel, glm::mat3(0.0f), p.J, p.mass};
+}
+
+inline void Pack(Particle& stored, const Particle& p) {
+    stored = p;
+}
+
+inline void Pack(VelocityParticle& stored, const Particle& p) {
+    stored = {p.pos, p.J, p.vel, p.mass};
+}
+
+template <typename Scalar, bool PackedVelocity>
+void Pack(CompactParticle<Scalar, PackedVelocity>& stored, const Particle& p) {
+    stored.pos = p.pos;
+    stored.J = p.J;
+    stored.vel = p.vel;
+    stored.mass = p.mass;
+    stored.C = p.C;
+}
+
+// One step of the solver, built once per instruction set
+namespace generic { void Step(); }
+#if defined(__x86_64__)
+namespace sse42 { void Step(); }
+namespace avx2 { void Step(); }
+namespace avx512 { void Step(); }
+#endif
@@ -0,0 +1,10 @@
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "SimulationState.hpp"
+
+#if defined(__x86_64__)
+#pragma GCC target("avx2,fma")
+#define KERNEL_ISA avx2
+#include "SimulationKernels.hpp"
+#endif
@@ -0,0 +1,10 @@
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "SimulationState.hpp"
+
+#if defined(__x86_64__)
+#pragma GCC target("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma,prefer-vector-width=512")
+#define KERNEL_ISA avx512
+#include "SimulationKernels.hpp"
+#endif
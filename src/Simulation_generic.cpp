@@ -0,0 +1,8 @@
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "SimulationState.hpp"
+
+// Baseline of the target, what the compiler flags allow
+#define KERNEL_ISA generic
+#include "SimulationKernels.hpp"
@@ -0,0 +1,10 @@
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "SimulationState.hpp"
+
+#if defined(__x86_64__)
+#pragma GCC target("sse4.2")
+#define KERNEL_ISA sse42
+#include "SimulationKernels.hpp"
+#endif
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+// Channel publishing the solver's particles to other processes through a
+// POSIX shared memory object: a header, then a ring of `slots` snapshots.
+// The solver fills the next slot after every step and never waits for the
+// readers, which map the object read only and read the particles in place.
+// Each slot is guarded by a sequence lock, odd while the solver writes the
+// slot: a reader checks that it has not moved once done with the data, and
+// takes a newer snapshot if it has. A reader has slots - 1 steps to go
+// through a snapshot before it gets overwritten. Only depends on the
+// system headers, tools can include it alone.
+
+// Record format of the particles, the solver's storage type (Simulation.hpp)
+enum SnapshotLayout : uint32_t {
+    SNAPSHOT_PARTICLE,            // Particle
+    SNAPSHOT_VELOCITY_PARTICLE,   // VelocityParticle
+    SNAPSHOT_COMPACT_FP16,        // CompactParticle<Half, false>
+    SNAPSHOT_COMPACT_FP16_PACKED, // CompactParticle<Half, true>
+    SNAPSHOT_COMPACT_BF16,        // CompactParticle<BFloat16, false>
+    SNAPSHOT_COMPACT_BF16_PACKED  // CompactParticle<BFloat16, true>
+};
+
+struct SnapshotHeader {
+    static const uint32_t magic_value = 0x4d504d53; // "SMPM"
+    static const uint32_t version_value = 1;
+    static const size_t bytes = 4096; // The slots start on the next page
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t slot_bytes; // From a slot to the next, its SnapshotSlot included
+    uint64_t capacity;   // Bytes of particles a slot holds
+    // Snapshots published so far, the last one in slot (published - 1) % slots
+    std::atomic<uint64_t> published;
+};
+
+struct alignas(64) SnapshotSlot {
+    // 2n + 1 while snapshot n is written, 2n + 2 once it is complete
+    std::atomic<uint64_t> sequence;
+    uint64_t step;     // Steps the solver had taken
+    uint32_t count;    // Particles
+    uint32_t layout;   // SnapshotLayout
+    uint32_t stride;   // Bytes per particle, each starting with its position as 3 floats
+    int32_t origin[3]; // GridOrigin(), which the positions are relative to
+
+    const void* Particles() const { return this + 1; }
+    void* Particles() { return this + 1; }
+};
+
+// Shared across processes, the atomics have to work without a lock
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+// The solver's end, a single writer
+class SnapshotWriter {
+public:
+    SnapshotWriter() = default;
+    ~SnapshotWriter() { Close(); }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Creates the shared memory object `name` ("/name", as shm_open takes
+    // it) with `slots` slots of `capacity` bytes of particles, replacing
+    // any other object of that name. The one already open is kept when it
+    // matches, so that readers stay attached.
+    bool Open(const std::string& name, uint32_t slots, uint64_t capacity) {
+        if (header && name == path && header->slots == slots && header->capacity >= capacity)
+            return true;
+        Close();
+
+        uint64_t slot_bytes = (sizeof(SnapshotSlot) + capacity + SnapshotHeader::bytes - 1) /
+                              SnapshotHeader::bytes * SnapshotHeader::bytes;
+        size_t size = SnapshotHeader::bytes + slots * slot_bytes;
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0)
+            return false;
+        void* data = MAP_FAILED;
+        if (ftruncate(fd, size) == 0)
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        // Zero pages: every slot's sequence reads as never written
+        header = (SnapshotHeader*)data;
+        header->slots = slots;
+        header->slot_bytes = slot_bytes;
+        header->capacity = capacity;
+        header->version = SnapshotHeader::version_value;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = SnapshotHeader::magic_value;
+        path = name;
+        bytes = size;
+        return true;
+    }
+
+    // Unmaps and removes the object, attached readers keep their mapping
+    void Close() {
+        if (!header)
+            return;
+        munmap(header, bytes);
+        shm_unlink(path.c_str());
+        header = nullptr;
+        path.clear();
+    }
+
+    bool IsOpen() const { return header != nullptr; }
+    uint64_t Capacity() const { return header ? header->capacity : 0; }
+
+    // Starts the next snapshot and returns where its particles go,
+    // Capacity() bytes
+    void* Begin(uint64_t step, uint32_t count, uint32_t layout, uint32_t stride, const int32_t origin[3]) {
+        uint64_t n = header->published.load(std::memory_order_relaxed);
+        current = slot(n);
+        current->sequence.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        current->step = step;
+        current->count = count;
+        current->layout = layout;
+        current->stride = stride;
+        for (int a = 0; a < 3; ++a)
+            current->origin[a] = origin[a];
+        return current->Particles();
+    }
+
+    // Publishes the snapshot Begin() started
+    void End() {
+        uint64_t n = header->published.load(std::memory_order_relaxed);
+        current->sequence.store(2 * n + 2, std::memory_order_release);
+        header->published.store(n + 1, std::memory_order_release);
+    }
+
+private:
+    SnapshotHeader* header = nullptr;
+    std::string path;
+    size_t bytes = 0;
+    SnapshotSlot* current = nullptr;
+
+    SnapshotSlot* slot(uint64_t n) {
+        return (SnapshotSlot*)((char*)header + SnapshotHeader::bytes + n % header->slots * header->slot_bytes);
+    }
+};
+
+// A snapshot as a reader sees it, intact as long as Check() says so
+struct SnapshotView {
+    const SnapshotSlot* slot = nullptr;
+    uint64_t sequence = 0;
+
+    // Of the snapshots published, from 0
+    uint64_t Number() const { return sequence / 2 - 1; }
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader() = default;
+    ~SnapshotReader() { Close(); }
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    // Attaches to the channel `name`, false if the solver has not created it
+    bool Open(const std::string& name) {
+        Close();
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size > SnapshotHeader::bytes)
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        header = (const SnapshotHeader*)data;
+        bytes = st.st_size;
+        // Stale or foreign objects: the slots have to fit the mapping
+        size_t room = bytes - SnapshotHeader::bytes;
+        if (header->magic != SnapshotHeader::magic_value || header->version != SnapshotHeader::version_value ||
+            header->slots == 0 || header->slot_bytes < sizeof(SnapshotSlot) ||
+            header->capacity > header->slot_bytes - sizeof(SnapshotSlot) ||
+            header->slot_bytes > room || header->slots > room / header->slot_bytes) {
+            Close();
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    void Close() {
+        if (header)
+            munmap((void*)header, bytes);
+        header = nullptr;
+    }
+
+    bool IsOpen() const { return header != nullptr; }
+    uint64_t Capacity() const { return header->capacity; }
+
+    uint64_t Published() const {
+        return header->published.load(std::memory_order_acquire);
+    }
+
+    // The newest complete snapshot, false when none was published yet
+    bool Latest(SnapshotView& view) const {
+        for (;;) {
+            uint64_t published = Published();
+            if (published == 0)
+                return false;
+            const SnapshotSlot* s = slot(published - 1);
+            uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+            // Otherwise the solver has moved on, past a newer one
+            if (sequence == 2 * published) {
+                view = {s, sequence};
+                return true;
+            }
+            // Lets the solver finish the slot rather than compete for its core
+            std::this_thread::yield();
+        }
+    }
+
+    // Whether the snapshot is still intact: what was read from it before a
+    // true is consistent, after a false it may be torn. Fields read before
+    // the check may be torn too, bound the particle reads by Capacity().
+    bool Check(const SnapshotView& view) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+    }
+
+private:
+    const SnapshotHeader* header = nullptr;
+    size_t bytes = 0;
+
+    const SnapshotSlot* slot(uint64_t n) const {
+        return (const SnapshotSlot*)((const char*)header + SnapshotHeader::bytes +
+                                     n % header->slots * header->slot_bytes);
+    }
+};
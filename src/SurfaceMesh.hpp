@@ -0,0 +1,222 @@
+#pragma once
+
+#include "Mesh.hpp"
+#include "ResourceManager.hpp"
+#include "ThreadPool.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Extracts the free surface as the `iso` level set of the grid mass field
+// with marching cubes. Each cube is split into the six tetrahedra of the
+// Freudenthal decomposition, whose face diagonals agree between neighbours,
+// so the mesh is watertight without the 256 case tables.
+// Only blocks the level set crosses are polygonized, the cost follows the
+// surface area rather than the particle count.
+class SurfaceMesh {
+public:
+    GLuint VAO;
+    std::vector<Vertex> vertices;
+
+    SurfaceMesh(int blockSize, float iso);
+    ~SurfaceMesh();
+
+    // cellAt(x, y, z) returns the grid cell, whatever the grid layout, for
+    // cells of the `size` grid at `origin` in the domain (GridSize() and
+    // GridOrigin()). The mesh is placed in domain coordinates, its blocks
+    // are polygonized on `pool`.
+    template <typename CellAt>
+    void Update(CellAt cellAt, glm::ivec3 origin, glm::ivec3 size, ThreadPool& pool);
+    void Draw();
+
+private:
+    GLuint VBO;
+    glm::ivec3 origin;
+    glm::ivec3 size;
+    int blockSize;
+    float iso;
+
+    std::vector<uint8_t> crossed; // Per block, x fastest
+    std::vector<glm::ivec3> crossing;
+    std::vector<std::vector<Vertex>> threadVertices;
+
+    void setupMesh();
+
+    static glm::ivec3 blockAt(glm::ivec3 blocks, uint32_t i) {
+        return glm::ivec3(i % blocks.x, (i / blocks.x) % blocks.y, i / (blocks.x * blocks.y));
+    }
+
+    template <typename CellAt>
+    float mass(CellAt cellAt, int x, int y, int z) const {
+        x = std::clamp(x, 0, size.x - 1);
+        y = std::clamp(y, 0, size.y - 1);
+        z = std::clamp(z, 0, size.z - 1);
+        return cellAt(x, y, z).mass;
+    }
+
+    template <typename CellAt>
+    glm::vec3 normal(CellAt cellAt, int x, int y, int z) const {
+        // The surface normal points down the mass gradient
+        return -glm::vec3(mass(cellAt, x + 1, y, z) - mass(cellAt, x - 1, y, z),
+                          mass(cellAt, x, y + 1, z) - mass(cellAt, x, y - 1, z),
+                          mass(cellAt, x, y, z + 1) - mass(cellAt, x, y, z - 1));
+    }
+
+    template <typename CellAt>
+    void polygonizeBlock(CellAt cellAt, glm::ivec3 block, std::vector<Vertex>& out) const;
+};
+
+SurfaceMesh::SurfaceMesh(int blockSize, float iso) {
+    this->origin = glm::ivec3(0);
+    this->size = glm::ivec3(0);
+    this->blockSize = blockSize;
+    this->iso = iso;
+    setupMesh();
+
+    ResourceManager::LoadShader("surface", "shaders/surface.vert",
+                                           "shaders/surface.frag");
+}
+
+SurfaceMesh::~SurfaceMesh() {
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &VBO);
+}
+
+void SurfaceMesh::setupMesh() {
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex,normal));
+    glEnableVertexAttribArray(1);
+
+    glBindVertexArray(0);
+}
+
+template <typename CellAt>
+void SurfaceMesh::Update(CellAt cellAt, glm::ivec3 origin, glm::ivec3 size, ThreadPool& pool) {
+    this->origin = origin;
+    this->size = size;
+
+    // Blocks of cubes whose corner masses straddle the iso value, scanned on
+    // the pool and gathered in block order
+    glm::ivec3 blocks = (size - 1 + blockSize - 1) / blockSize;
+    uint32_t count = blocks.x * blocks.y * blocks.z;
+    crossed.assign(count, 0);
+    pool.ParallelFor(0, count, 8, [&](uint32_t first, uint32_t last) {
+        for (uint32_t i = first; i < last; ++i) {
+            glm::ivec3 lo = blockAt(blocks, i) * blockSize;
+            glm::ivec3 hi = glm::min(lo + blockSize, size - 1);
+            bool above = false, below = false;
+            for (int z = lo.z; z <= hi.z && !(above && below); ++z) {
+                for (int y = lo.y; y <= hi.y; ++y) {
+                    for (int x = lo.x; x <= hi.x; ++x) {
+                        float m = cellAt(x, y, z).mass;
+                        above |= m > iso;
+                        below |= m <= iso;
+                    }
+                }
+            }
+            crossed[i] = above && below;
+        }
+    });
+    crossing.clear();
+    for (uint32_t i = 0; i < count; ++i)
+        if (crossed[i])
+            crossing.push_back(blockAt(blocks, i));
+
+    threadVertices.resize(pool.Slots());
+    for (auto& local: threadVertices)
+        local.clear();
+    pool.ParallelFor(0, crossing.size(), 4, [&](uint32_t first, uint32_t last) {
+        auto& local = threadVertices[ThreadPool::WorkerIndex()];
+        for (uint32_t i = first; i < last; ++i)
+            polygonizeBlock(cellAt, crossing[i], local);
+    });
+
+    vertices.clear();
+    for (const auto& local: threadVertices)
+        vertices.insert(vertices.end(), local.begin(), local.end());
+
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STREAM_DRAW);
+}
+
+template <typename CellAt>
+void SurfaceMesh::polygonizeBlock(CellAt cellAt, glm::ivec3 block, std::vector<Vertex>& out) const {
+    // Corner c of a cube is offset by (c & 1, (c >> 1) & 1, c >> 2)
+    static const int tetrahedra[6][4] = {
+        {0, 1, 3, 7}, {0, 1, 5, 7}, {0, 2, 3, 7},
+        {0, 2, 6, 7}, {0, 4, 5, 7}, {0, 4, 6, 7}
+    };
+
+    glm::ivec3 lo = block * blockSize;
+    glm::ivec3 hi = glm::min(lo + blockSize, size - 1);
+
+    for (int z = lo.z; z < hi.z; ++z) {
+        for (int y = lo.y; y < hi.y; ++y) {
+            for (int x = lo.x; x < hi.x; ++x) {
+                glm::ivec3 corner[8];
+                float value[8];
+                for (int c = 0; c < 8; ++c) {
+                    corner[c] = glm::ivec3(x + (c & 1), y + ((c >> 1) & 1), z + (c >> 2));
+                    value[c] = mass(cellAt, corner[c].x, corner[c].y, corner[c].z);
+                }
+
+                auto edge = [&](int a, int b) {
+                    float t = (iso - value[a]) / (value[b] - value[a]);
+                    glm::vec3 na = normal(cellAt, corner[a].x, corner[a].y, corner[a].z);
+                    glm::vec3 nb = normal(cellAt, corner[b].x, corner[b].y, corner[b].z);
+                    // Grid nodes sit at the center of the cells
+                    return Vertex {
+                        glm::vec3(origin) + glm::mix(glm::vec3(corner[a]), glm::vec3(corner[b]), t) + 0.5f,
+                        glm::normalize(glm::mix(na, nb, t) + 1e-6f)
+                    };
+                };
+
+                for (const auto& tet: tetrahedra) {
+                    int inside[4], outside[4];
+                    int nIn = 0, nOut = 0;
+                    for (int v: tet) {
+                        if (value[v] > iso) inside[nIn++] = v;
+                        else outside[nOut++] = v;
+                    }
+
+                    if (nIn == 1 || nIn == 3) {
+                        // One corner alone on its side cuts off a triangle
+                        int lone = nIn == 1 ? inside[0] : outside[0];
+                        const int* rest = nIn == 1 ? outside : inside;
+                        out.push_back(edge(lone, rest[0]));
+                        out.push_back(edge(lone, rest[1]));
+                        out.push_back(edge(lone, rest[2]));
+                    } else if (nIn == 2) {
+                        // Two on each side cut a quad
+                        Vertex ac = edge(inside[0], outside[0]);
+                        Vertex ad = edge(inside[0], outside[1]);
+                        Vertex bd = edge(inside[1], outside[1]);
+                        Vertex bc = edge(inside[1], outside[0]);
+                        out.push_back(ac); out.push_back(ad); out.push_back(bd);
+                        out.push_back(ac); out.push_back(bd); out.push_back(bc);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void SurfaceMesh::Draw() {
+    if (vertices.empty())
+        return;
+    glBindVertexArray(VAO);
+    glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+    glBindVertexArray(0);
+}
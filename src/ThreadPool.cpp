@@ -0,0 +1,175 @@
+#include "ThreadPool.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+// The calling thread's slot, valid in the pool of id worker_pool
+static thread_local uint64_t worker_pool = 0;
+static thread_local int worker_index = 0;
+
+static std::atomic<uint64_t> next_pool_id {1};
+
+// The cores of the process affinity mask, in order
+static std::vector<int> allowed_cores() {
+    std::vector<int> cores;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                cores.push_back(cpu);
+    }
+    if (cores.empty())
+        cores.push_back(0);
+    return cores;
+}
+
+static void pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+ThreadPool::ThreadPool(int threads, bool pin, int callers) {
+    std::vector<int> cores = allowed_cores();
+    if (threads <= 0)
+        threads = cores.size();
+    size = threads;
+    id = next_pool_id.fetch_add(1);
+    worker_pool = id;
+    worker_index = 0;
+    for (int i = 0; i < threads + std::max(callers, 1) - 1; ++i)
+        queues.push_back(std::make_unique<Queue>());
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        if (pin)
+            pin_thread(workers.back().native_handle(), cores[i % cores.size()]);
+    }
+    if (pin)
+        pin_thread(pthread_self(), cores[0]);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& worker: workers)
+        worker.join();
+}
+
+int ThreadPool::AvailableCores() {
+    return allowed_cores().size();
+}
+
+int ThreadPool::WorkerIndex() {
+    return worker_index;
+}
+
+void ThreadPool::Submit(const Task& task) {
+    submitTo(self(), task);
+}
+
+int ThreadPool::self() {
+    if (worker_pool == id)
+        return worker_index;
+    // A thread new to the pool, the slots past the workers are the callers'
+    int slot = Size() + callersSeen.fetch_add(1) - 1;
+    if (slot >= Slots()) {
+        fprintf(stderr, "ThreadPool: more than %d threads outside the pool use it\n", Slots() - Size() + 1);
+        abort();
+    }
+    worker_pool = id;
+    worker_index = slot;
+    return slot;
+}
+
+void ThreadPool::submitTo(int worker, const Task& task) {
+    pending.fetch_add(1);
+    queues[worker]->Push(task);
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wake.notify_all();
+    }
+}
+
+void ThreadPool::Wait() {
+    int caller = self();
+    while (pending.load() > 0) {
+        if (!runOne(caller))
+            std::this_thread::yield();
+    }
+}
+
+void ThreadPool::waitFor(int self, const std::atomic<uint32_t>& remaining) {
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (!runOne(self))
+            std::this_thread::yield();
+    }
+}
+
+bool ThreadPool::runOne(int self) {
+    Task task;
+    bool found = queues[self]->Pop(task);
+    for (int k = 1; k < Slots() && !found; ++k)
+        found = queues[(self + k) % Slots()]->Steal(task);
+    if (!found)
+        return false;
+
+    task.run(task.context, task.index);
+    pending.fetch_sub(1);
+    return true;
+}
+
+void ThreadPool::workerLoop(int self) {
+    worker_pool = id;
+    worker_index = self;
+    while (!stop.load()) {
+        if (runOne(self))
+            continue;
+        // Spin while a step is in flight, sleep between steps
+        if (pending.load() > 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1);
+        wake.wait(lock, [this] { return stop.load() || pending.load() > 0; });
+        sleepers.fetch_sub(1);
+    }
+}
+
+void ThreadPool::Queue::Push(const Task& task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tail - head == tasks.size()) {
+        std::vector<Task> grown(tasks.size() * 2);
+        for (uint64_t i = head; i < tail; ++i)
+            grown[i % grown.size()] = tasks[i % tasks.size()];
+        tasks.swap(grown);
+    }
+    tasks[tail % tasks.size()] = task;
+    tail++;
+}
+
+bool ThreadPool::Queue::Pop(Task& task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tail == head)
+        return false;
+    tail--;
+    task = tasks[tail % tasks.size()];
+    return true;
+}
+
+bool ThreadPool::Queue::Steal(Task& task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tail == head)
+        return false;
+    task = tasks[head % tasks.size()];
+    head++;
+    return true;
+}
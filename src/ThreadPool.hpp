@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool: every worker owns a deque, runs its own tasks newest
+// first and steals the oldest tasks of the others when it runs dry. Tasks
+// are plain function pointers, submitting one never allocates once the
+// deques are warm. Threads outside the pool work as workers of their own
+// while they wait on it: the constructing thread as worker 0, up to
+// `callers - 1` other threads on the slots past the pool's workers, each
+// taking its slot the first time it uses the pool. Workers sleep when the
+// pool is idle, so sharing one pool between the solver and whatever else
+// (meshing, export) never oversubscribes cores.
+class ThreadPool {
+public:
+    struct Task {
+        void (*run)(void* context, uint32_t index);
+        void* context;
+        uint32_t index;
+    };
+
+    // threads <= 0 uses every core the process may run on. With `pin`, worker
+    // i (the constructing thread being worker 0) is bound to the i-th of them.
+    ThreadPool(int threads, bool pin = false, int callers = 4);
+    ~ThreadPool();
+
+    // Cores the process may run on
+    static int AvailableCores();
+
+    // Workers, the constructing thread included
+    int Size() const { return size; }
+    // Workers and the slots of the other threads, the range of WorkerIndex()
+    int Slots() const { return (int)queues.size(); }
+
+    // Slot of the calling thread in the pool it last used, 0 if none
+    static int WorkerIndex();
+
+    // Pushes on the calling worker's deque, tasks may submit tasks
+    void Submit(const Task& task);
+    // Runs tasks until every submitted one has completed
+    void Wait();
+
+    // Calls f(first, last) over [begin, end) in chunks of `grain` and
+    // returns once all chunks are done. Worker w is handed the chunks of the
+    // w-th slice of the range first and only steals once it is through them,
+    // so a range processed every step keeps hitting the same caches and
+    // NUMA node. Safe to call from a task, the caller runs tasks while it
+    // waits.
+    template <typename F>
+    void ParallelFor(uint32_t begin, uint32_t end, uint32_t grain, F f);
+
+    // Calls f(worker) once for every worker in [0, Size()), each on its own
+    // thread. One thread at a time: two gangs can hold each other's threads.
+    template <typename F>
+    void ForEachWorker(F f);
+
+private:
+    // Ring buffer, the owner pushes and pops at the tail, thieves take the head
+    struct Queue {
+        std::mutex mutex;
+        std::vector<Task> tasks = std::vector<Task>(1024);
+        uint64_t head = 0;
+        uint64_t tail = 0;
+
+        void Push(const Task& task);
+        bool Pop(Task& task);
+        bool Steal(Task& task);
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    int size;
+    uint64_t id; // Tells the pools apart in the threads' slots
+    std::atomic<int> callersSeen {1};
+
+    std::atomic<int64_t> pending {0};
+    std::atomic<int> sleepers {0};
+    std::atomic<bool> stop {false};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+
+    int self();
+    void submitTo(int worker, const Task& task);
+    bool runOne(int self);
+    void workerLoop(int self);
+    void waitFor(int self, const std::atomic<uint32_t>& remaining);
+
+    template <typename F>
+    struct Range {
+        F& f;
+        uint32_t begin, end, grain;
+        std::atomic<uint32_t> remaining;
+    };
+
+    template <typename F>
+    static void runChunk(void* context, uint32_t chunk);
+
+    template <typename F>
+    struct Gang {
+        F& f;
+        int size;
+        std::atomic<int> arrived;
+        std::atomic<uint32_t> remaining;
+    };
+
+    template <typename F>
+    static void runMember(void* context, uint32_t index);
+};
+
+template <typename F>
+void ThreadPool::ParallelFor(uint32_t begin, uint32_t end, uint32_t grain, F f) {
+    int caller = self();
+    if (begin >= end)
+        return;
+    grain = std::max(grain, 1u);
+    uint32_t chunks = (end - begin + grain - 1) / grain;
+    if (Size() == 1 || chunks == 1) {
+        f(begin, end);
+        return;
+    }
+
+    Range<F> range {f, begin, end, grain, {chunks}};
+    // Pushed last first: each worker pops its slice from the front, thieves
+    // take the back of the slices
+    for (uint32_t c = chunks; c-- > 0;)
+        submitTo((uint64_t)c * Size() / chunks, {runChunk<F>, &range, c});
+    waitFor(caller, range.remaining);
+}
+
+template <typename F>
+void ThreadPool::runChunk(void* context, uint32_t chunk) {
+    Range<F>& range = *(Range<F>*)context;
+    uint32_t first = range.begin + chunk * range.grain;
+    uint32_t last = std::min(first + range.grain, range.end);
+    range.f(first, last);
+    range.remaining.fetch_sub(1, std::memory_order_release);
+}
+
+template <typename F>
+void ThreadPool::ForEachWorker(F f) {
+    int caller = self();
+    if (Size() == 1) {
+        f(0);
+        return;
+    }
+
+    Gang<F> gang {f, Size(), {0}, {(uint32_t)Size()}};
+    for (int w = 0; w < Size(); ++w)
+        submitTo(w, {runMember<F>, &gang, (uint32_t)w});
+    waitFor(caller, gang.remaining);
+}
+
+template <typename F>
+void ThreadPool::runMember(void* context, uint32_t index) {
+    Gang<F>& gang = *(Gang<F>*)context;
+    // Holding the thread until every member has started keeps two members
+    // off the same thread. A member is usually run by the worker it was
+    // submitted to, but a waiting caller may have stolen it.
+    gang.arrived.fetch_add(1);
+    while (gang.arrived.load() < gang.size)
+        std::this_thread::yield();
+    gang.f(index);
+    gang.remaining.fetch_sub(1, std::memory_order_release);
+}
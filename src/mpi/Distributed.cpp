@@ -0,0 +1,325 @@
+// Only built by the MPI compiler wrappers, hence outside of src/*.cpp
+
+#define GLM_PRECITION_LOWP_FLOAT
+#define GLM_FORCE_PURE
+
+#include "Distributed.hpp"
+#include "SimulationState.hpp"
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+// One side of the slab. Both ranks list the cells they share in the same
+// order, domain x then y then z, so the planes travel as flat arrays.
+struct Neighbour {
+    int rank; // MPI_PROC_NULL past the ends of the domain, with no cells
+    std::vector<uint32_t> halo, edge; // Cell indices, the halo on this side and the slab's edge under it
+    std::vector<uint32_t> halo_blocks, edge_blocks;
+    std::vector<float> send, receive;
+    MPI_Request requests[2];
+};
+
+enum {
+    TAG_MASS,
+    TAG_GRID,
+    TAG_VELOCITY,
+    TAG_COUNT,
+    TAG_PARTICLES
+};
+
+static SlabExchange exchange;
+static Neighbour neighbours[2]; // Left (lower x), right
+static int slab_first = 0, slab_last = 0;
+
+// Flags a block the neighbours wrote into, so that it is updated and
+// cleared like the ones P2G touched
+static void Activate(uint32_t block) {
+    if (!block_active[block]) {
+        block_active[block] = 1;
+        active_blocks.push_back(block);
+    }
+}
+
+static bool nonzero(const float* values, int count) {
+    return std::any_of(values, values + count, [](float value) { return value != 0.0f; });
+}
+
+// Sends `channels` floats per shared cell from each neighbour's `send` and
+// receives as many into its `receive`
+static void Post(int tag, int channels) {
+    for (Neighbour& n: neighbours) {
+        int count = (int)n.halo.size() * channels;
+        MPI_Irecv(n.receive.data(), count, MPI_FLOAT, n.rank, tag, MPI_COMM_WORLD, &n.requests[0]);
+        MPI_Isend(n.send.data(), count, MPI_FLOAT, n.rank, tag, MPI_COMM_WORLD, &n.requests[1]);
+    }
+}
+
+static void Finish() {
+    for (Neighbour& n: neighbours)
+        MPI_Waitall(2, n.requests, MPI_STATUSES_IGNORE);
+}
+
+// Halo mass to the owner, then the summed edge mass back into the halo
+static void ExchangeMass() {
+    for (Neighbour& n: neighbours)
+        for (size_t k = 0; k < n.halo.size(); ++k)
+            n.send[k] = grid.mass[n.halo[k]];
+    Post(TAG_MASS, 1);
+    Finish();
+    for (Neighbour& n: neighbours) {
+        for (size_t k = 0; k < n.edge.size(); ++k) {
+            if (n.receive[k] != 0.0f) {
+                grid.mass[n.edge[k]] += n.receive[k];
+                Activate(n.edge_blocks[k]);
+            }
+        }
+    }
+
+    for (Neighbour& n: neighbours)
+        for (size_t k = 0; k < n.edge.size(); ++k)
+            n.send[k] = grid.mass[n.edge[k]];
+    Post(TAG_MASS, 1);
+    Finish();
+    for (Neighbour& n: neighbours) {
+        for (size_t k = 0; k < n.halo.size(); ++k) {
+            grid.mass[n.halo[k]] = n.receive[k];
+            if (n.receive[k] != 0.0f)
+                Activate(n.halo_blocks[k]);
+        }
+    }
+}
+
+// Floats per cell of the P2G sums: momentum, the FLIP stress momentum, and
+// the mass unless ExchangeMass() has sent it
+static int GridChannels() {
+    return 3 + (transfer_in_use == TRANSFER_FLIP ? 3 : 0) + (volume_ratio() ? 1 : 0);
+}
+
+static void PostGrid() {
+    const bool flip = transfer_in_use == TRANSFER_FLIP, mass = volume_ratio();
+    for (Neighbour& n: neighbours) {
+        float* out = n.send.data();
+        for (uint32_t cell: n.halo) {
+            const glm::vec3& vel = grid.vel[cell];
+            *out++ = vel.x; *out++ = vel.y; *out++ = vel.z;
+            if (flip) {
+                const glm::vec3& stress = grid.stress[cell];
+                *out++ = stress.x; *out++ = stress.y; *out++ = stress.z;
+            }
+            if (mass)
+                *out++ = grid.mass[cell];
+        }
+    }
+    Post(TAG_GRID, GridChannels());
+}
+
+static void FinishGrid() {
+    const bool flip = transfer_in_use == TRANSFER_FLIP, mass = volume_ratio();
+    const int channels = GridChannels();
+    Finish();
+    for (Neighbour& n: neighbours) {
+        const float* in = n.receive.data();
+        for (size_t k = 0; k < n.edge.size(); ++k, in += channels) {
+            if (!nonzero(in, channels))
+                continue;
+            uint32_t cell = n.edge[k];
+            grid.vel[cell] += glm::vec3(in[0], in[1], in[2]);
+            if (flip)
+                grid.stress[cell] += glm::vec3(in[3], in[4], in[5]);
+            if (mass)
+                grid.mass[cell] += in[channels - 1];
+            Activate(n.edge_blocks[k]);
+        }
+    }
+}
+
+// Floats per cell of the updated velocity, and the velocity before the
+// update under FLIP
+static int VelocityChannels() {
+    return transfer_in_use == TRANSFER_FLIP ? 6 : 3;
+}
+
+static void PostVelocity() {
+    const bool flip = transfer_in_use == TRANSFER_FLIP;
+    for (Neighbour& n: neighbours) {
+        float* out = n.send.data();
+        for (uint32_t cell: n.edge) {
+            const glm::vec3& vel = grid.vel[cell];
+            *out++ = vel.x; *out++ = vel.y; *out++ = vel.z;
+            if (flip) {
+                const glm::vec3& old_vel = grid.old_vel[cell];
+                *out++ = old_vel.x; *out++ = old_vel.y; *out++ = old_vel.z;
+            }
+        }
+    }
+    Post(TAG_VELOCITY, VelocityChannels());
+}
+
+static void FinishVelocity() {
+    const bool flip = transfer_in_use == TRANSFER_FLIP;
+    const int channels = VelocityChannels();
+    Finish();
+    for (Neighbour& n: neighbours) {
+        const float* in = n.receive.data();
+        for (size_t k = 0; k < n.halo.size(); ++k, in += channels) {
+            uint32_t cell = n.halo[k];
+            glm::vec3 vel = glm::vec3(in[0], in[1], in[2]);
+            grid.vel[cell] = vel;
+            if (flip)
+                grid.old_vel[cell] = glm::vec3(in[3], in[4], in[5]);
+            if (half_grid_in_use)
+                grid.half_vel[cell] = vel;
+            if (nonzero(in, channels))
+                Activate(n.halo_blocks[k]);
+        }
+    }
+}
+
+// Cells of the grid window with x in [x0, x1), in the order both ranks
+// list them
+static void ListCells(int x0, int x1, std::vector<uint32_t>& cells, std::vector<uint32_t>& blocks) {
+    cells.clear();
+    blocks.clear();
+    for (int x = x0; x < x1; ++x) {
+        for (int y = 0; y < grid_size.y; ++y) {
+            for (int z = 0; z < grid_size.z; ++z) {
+                cells.push_back(CellIndex(x, y, z));
+                blocks.push_back(BlockIndex(glm::uvec3(x, y, z) / (uint32_t)block_size));
+            }
+        }
+    }
+}
+
+// Hands the particles past the slab's edges to the neighbours and takes
+// theirs. Particles move less than a cell per step, so they only ever go
+// one slab over.
+template <typename P>
+static void Migrate() {
+    auto& stored = ParticleStorage<P>();
+    const float first = (float)exchange.first, last = (float)exchange.last;
+    auto side = [&](const P& p) {
+        if (p.pos.x < first && neighbours[0].rank != MPI_PROC_NULL)
+            return 0;
+        if (p.pos.x >= last && neighbours[1].rank != MPI_PROC_NULL)
+            return 1;
+        return -1;
+    };
+
+    // Leaving particles, in domain coordinates, compacted out of `stored`
+    uint64_t leaving[2] = {0, 0};
+    for (const P& p: stored)
+        if (side(p) >= 0)
+            leaving[side(p)]++;
+    Span<P> out[2] = {step_arena.Allocate<P>(leaving[0]), step_arena.Allocate<P>(leaving[1])};
+    uint64_t filled[2] = {0, 0};
+    size_t kept = 0;
+    for (size_t i = 0; i < stored.size(); ++i) {
+        int s = side(stored[i]);
+        if (s < 0) {
+            stored[kept++] = stored[i];
+            continue;
+        }
+        P& p = out[s][filled[s]++];
+        p = stored[i];
+        p.pos.x += (float)grid_origin.x;
+    }
+
+    // To the left and from the right, then the other way
+    uint64_t arriving[2] = {0, 0};
+    for (int s = 0; s < 2; ++s)
+        MPI_Sendrecv(&leaving[s], 1, MPI_UINT64_T, neighbours[s].rank, TAG_COUNT,
+                     &arriving[1 - s], 1, MPI_UINT64_T, neighbours[1 - s].rank, TAG_COUNT,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    stored.resize(kept + arriving[0] + arriving[1]);
+    P* in[2] = {stored.data() + kept, stored.data() + kept + arriving[0]};
+    for (int s = 0; s < 2; ++s)
+        MPI_Sendrecv(out[s].data, (int)(leaving[s] * sizeof(P)), MPI_BYTE, neighbours[s].rank, TAG_PARTICLES,
+                     in[1 - s], (int)(arriving[1 - s] * sizeof(P)), MPI_BYTE, neighbours[1 - s].rank, TAG_PARTICLES,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    for (size_t i = kept; i < stored.size(); ++i)
+        stored[i].pos.x -= (float)grid_origin.x;
+}
+
+void InitDistributed(unsigned int seed) {
+    int rank, ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+    exchange = {};
+    slab_exchange = &exchange;
+    Init(seed);
+
+    const int halo = (kernel_order_in_use == KERNEL_CUBIC ? 2 : 1) + 2;
+    slab_first = (int)((int64_t)domain_in_use.x * rank / ranks);
+    slab_last = (int)((int64_t)domain_in_use.x * (rank + 1) / ranks);
+    if (slab_last - slab_first < 2 * halo) {
+        std::cerr << ranks << " slabs along a domain " << domain_in_use.x << " cells wide are under "
+                  << 2 * halo << " cells" << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    // The scene was made in a window at the domain's corner. The ends of the
+    // domain have no halo, their particles stay inside as on a single grid.
+    int window_first = std::max(slab_first - halo, 0);
+    int window_last = std::min(slab_last + halo, domain_in_use.x);
+    glm::vec3 shift = glm::vec3(glm::ivec3(window_first, 0, 0) - grid_origin);
+    grid_origin = glm::ivec3(window_first, 0, 0);
+    grid_size = glm::ivec3(window_last - window_first, domain_in_use.y, domain_in_use.z);
+    exchange.first = slab_first - window_first;
+    exchange.last = slab_last - window_first;
+    exchange.halo = halo;
+    exchange.exchange_mass = ExchangeMass;
+    exchange.post_grid = PostGrid;
+    exchange.finish_grid = FinishGrid;
+    exchange.post_velocity = PostVelocity;
+    exchange.finish_velocity = FinishVelocity;
+    WithParticleStorage([&](auto* storage) {
+        auto& stored = ParticleStorage<std::remove_pointer_t<decltype(storage)>>();
+        size_t kept = 0;
+        for (size_t i = 0; i < stored.size(); ++i) {
+            float x = stored[i].pos.x - shift.x;
+            if ((x >= exchange.first || rank == 0) && (x < exchange.last || rank == ranks - 1)) {
+                stored[kept] = stored[i];
+                stored[kept++].pos -= shift;
+            }
+        }
+        stored.resize(kept);
+    });
+    AssignGrid(SolverPool());
+
+    neighbours[0].rank = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    neighbours[1].rank = rank < ranks - 1 ? rank + 1 : MPI_PROC_NULL;
+    for (int s = 0; s < 2; ++s) {
+        Neighbour& n = neighbours[s];
+        if (n.rank == MPI_PROC_NULL) {
+            ListCells(0, 0, n.halo, n.halo_blocks);
+            ListCells(0, 0, n.edge, n.edge_blocks);
+        } else if (s == 0) {
+            ListCells(exchange.first - halo, exchange.first, n.halo, n.halo_blocks);
+            ListCells(exchange.first, exchange.first + halo, n.edge, n.edge_blocks);
+        } else {
+            ListCells(exchange.last, exchange.last + halo, n.halo, n.halo_blocks);
+            ListCells(exchange.last - halo, exchange.last, n.edge, n.edge_blocks);
+        }
+        size_t floats = n.halo.size() * std::max(GridChannels(), VelocityChannels());
+        n.send.assign(floats, 0.0f);
+        n.receive.assign(floats, 0.0f);
+    }
+}
+
+void SimulateDistributed() {
+    Simulate();
+    WithParticleStorage([](auto* storage) {
+        Migrate<std::remove_pointer_t<decltype(storage)>>();
+    });
+}
+
+int SlabFirst() {
+    return slab_first;
+}
+
+int SlabLast() {
+    return slab_last;
+}